@@ -2,11 +2,27 @@
 #include <thread>
 #include <cstring>
 #include <sstream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <atomic>
+#include <map>
+#include <deque>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <climits>
 
 #define NDEBUG
 #define RELEASE
 
 #include "/usr/lib/dart/include/dart_api.h"
+#include "bin/dartutils.h"
 #include "bin/thread.h"
 #include "vm/thread.h"
 #include "vm/isolate.h"
@@ -17,25 +33,177 @@
 #include "vm/thread_pool.h"
 #include "vm/version.h"
 
+#include "antman_abi.h"
+#include "control.h"
+#include "timing.h"
+#include "kernel_cache.h"
+#include "work_queue.h"
+#include "log_ring.h"
+#include "info_writer.h"
+
 using std::string;
 using std::to_string;
 
-void antmanInit() {
-  static bool isInitialized = false;
-  if (!isInitialized) {
-    std::cout << "Antman initialized." << std::endl;
-    isInitialized = true;
+// Read by the injector straight from our memory to decide whether it has to
+// reload us. Like the functions the injector calls, it is exported with C
+// linkage so it is found by its plain name.
+extern "C" const uint32_t antmanAbiVersion = antmanAbi;
+
+// Our diagnostics go to a log ring in a memfd that `dart-inject tail` reads,
+// not to the target's stdout and stderr. The descriptor stays open so the
+// injector can find the ring under /proc/<pid>/fd.
+struct AntmanLog {
+  std::once_flag created;
+  int fd = -1;
+  void* mapping = nullptr;
+  LogRing ring;
+  std::atomic<bool> open{false};
+};
+
+static AntmanLog antmanLog;
+
+static void createLog() {
+  auto size = logRingSize(logRingSlots);
+  int fd = memfd_create(logRingName, MFD_CLOEXEC);
+  if (fd == -1 || ftruncate(fd, static_cast<off_t>(size)) == -1) {
+    if (fd != -1) close(fd);
+    return;
+  }
+
+  auto mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+
+  antmanLog.fd = fd;
+  antmanLog.mapping = mapping;
+  antmanLog.ring.attach(mapping, size, true);
+  antmanLog.open = true;
+}
+
+// Appends to the log ring, falls back to stderr if it couldn't be created.
+static void logMessage(LogSeverity severity, const string& message, int64_t isolate = 0) {
+  std::call_once(antmanLog.created, createLog);
+  if (antmanLog.open) {
+    antmanLog.ring.write(severity, isolate, message.data(), message.size());
+  } else {
+    std::cerr << message << std::endl;
   }
 }
 
+static void startControlChannel();
+
+extern "C" void antmanInit() {
+  static std::once_flag initialized;
+  std::call_once(initialized, [] {
+    startControlChannel();
+    logMessage(LogSeverity::info, "Antman initialized.");
+  });
+}
+
+// The VM is usable once Dart_Initialize set up the vm isolate and the
+// embedder's isolate creation callback. Both are looked up by name instead of
+// through the VM's inline accessors: those read VM data symbols, which unlike
+// functions are bound as soon as we are loaded, so a process without the VM
+// couldn't load us at all.
+static bool vmReady() {
+  static auto vmIsolate = reinterpret_cast<dart::Isolate* const*>(
+    dlsym(RTLD_DEFAULT, "_ZN4dart4Dart11vm_isolate_E"));
+  static auto createCallback = reinterpret_cast<const Dart_IsolateCreateCallback*>(
+    dlsym(RTLD_DEFAULT, "_ZN4dart7Isolate16create_callback_E"));
+  return vmIsolate != nullptr && createCallback != nullptr && *vmIsolate != nullptr && *createCallback != nullptr;
+}
+
+// Drops us from LD_PRELOAD so processes the target starts don't load antman.
+// Runs in our constructor, before the process has other threads that could
+// read the environment.
+static void stripPreload() {
+  auto preload = getenv("LD_PRELOAD");
+  Dl_info self;
+  if (preload == nullptr || dladdr(reinterpret_cast<void*>(&stripPreload), &self) == 0 || self.dli_fname == nullptr) {
+    return;
+  }
+
+  string ownName = self.dli_fname;
+  ownName = ownName.substr(ownName.rfind('/') + 1);
+
+  // Entries are separated by colons or spaces.
+  string kept, entry;
+  std::istringstream entries(preload);
+  while (entries >> entry) {
+    for (size_t start = 0, end; start <= entry.size(); start = end + 1) {
+      end = std::min(entry.find(':', start), entry.size());
+      auto path = entry.substr(start, end - start);
+      if (path.empty() || path == self.dli_fname || path.substr(path.rfind('/') + 1) == ownName) continue;
+      if (!kept.empty()) kept += ':';
+      kept += path;
+    }
+  }
+
+  if (kept.empty()) {
+    unsetenv("LD_PRELOAD");
+  } else {
+    setenv("LD_PRELOAD", kept.c_str(), 1);
+  }
+}
+
+// When started with LD_PRELOAD (or linked into the embedder) we are loaded
+// before the VM exists. Wait for it on a plain thread, the VM's own threads
+// can't be used before Dart_Initialize, and initialize then. Interposing
+// Dart_Initialize wouldn't work for the standalone VM, which calls it
+// directly. When injected the VM is already up and the injector calls
+// antmanInit itself.
+__attribute__((constructor)) static void antmanPreload() {
+  stripPreload();
+
+  // Processes that inherited LD_PRELOAD from elsewhere and don't embed the VM.
+  if (dlsym(RTLD_DEFAULT, "Dart_Initialize") == nullptr || vmReady()) return;
+
+  std::thread([] {
+    while (!vmReady()) usleep(20000);
+    antmanInit();
+  }).detach();
+}
+
+// Threads that run antman code, antmanShutdown waits for them before the
+// library may be unloaded.
+static std::atomic<int> liveThreads{0};
+static std::atomic<bool> shuttingDown{false};
+
+struct ThreadStart {
+  void (*function)(dart::uword);
+  dart::uword parameter;
+};
+
+static void startThread(const char* name, void (*function)(dart::uword), dart::uword parameter) {
+  liveThreads++;
+  dart::OSThread::Start(name, [](dart::uword targs) {
+    auto start = *reinterpret_cast<ThreadStart*>(targs);
+    delete reinterpret_cast<ThreadStart*>(targs);
+    start.function(start.parameter);
+    liveThreads--;
+  }, reinterpret_cast<dart::uword>(new ThreadStart{function, parameter}));
+}
+
 struct DartIsolateGuard {
-  explicit DartIsolateGuard(dart::Isolate* isolate) {
+  explicit DartIsolateGuard(dart::Isolate* isolate) : isolate(isolate) {
     Dart_EnterIsolate(reinterpret_cast<Dart_Isolate>(isolate));
   }
 
   ~DartIsolateGuard() {
-    Dart_ShutdownIsolate();
+    if (isolate != nullptr) Dart_ShutdownIsolate();
   }
+
+  // Exits the isolate without shutting it down, to hand it to another thread.
+  dart::Isolate* release() {
+    Dart_ExitIsolate();
+    auto released = isolate;
+    isolate = nullptr;
+    return released;
+  }
+
+  dart::Isolate* isolate;
 };
 
 struct DartScopeGuard {
@@ -44,101 +212,1491 @@ struct DartScopeGuard {
   }
 
   ~DartScopeGuard() {
+    if (entered) Dart_ExitScope();
+  }
+
+  void exit() {
     Dart_ExitScope();
+    entered = false;
   }
+
+  bool entered = true;
 };
 
-void antmanSpawn(const char* uri) {
-  auto uriCopy = new char[strlen(uri)];
-  strcpy(uriCopy, uri);
+static std::mutex spawnMutex;
 
-  dart::OSThread::Start("antmanSpawnUri", [](dart::uword targs) {
-    auto uriCopy = string(reinterpret_cast<char*>(targs));
-    delete reinterpret_cast<char*>(targs);
+// What the status command reports about a spawn, looked up by the id
+// antmanSpawn returns. Guarded by spawnMutex.
+struct SpawnHandle {
+  unsigned id;
+  string uri;
+  // queued, starting, compiling, loading, running, done or failed.
+  const char* state = "queued";
+  string error;
+  PhaseTimer timer;
+  string isolateName;
+  Dart_Port port = 0;
 
-    char* error;
-    auto isolate = reinterpret_cast<dart::Isolate*>(
-      dart::Isolate::CreateCallback()(uriCopy.c_str(), "main", nullptr, nullptr, nullptr, nullptr, &error)
-    );
+  // What the spawn's isolates printed, the last spawnOutputLimit bytes of it.
+  string output;
+  // Offset of output[0] in everything the spawn printed.
+  uint64_t outputStart = 0;
+  // Native port print is redirected to, ILLEGAL_PORT if it couldn't be opened.
+  Dart_Port printPort = ILLEGAL_PORT;
+  // Set once everything the spawn's isolates printed arrived on the print port.
+  bool outputClosed = false;
+  // Isolates of the spawn, --instances included, that are queued or running.
+  int outstanding = 0;
 
-    if (error != nullptr) {
-      free(error);
-      std::cerr << "Isolate creation error: " << error << std::endl << std::endl;
-      return;
-    } else if (isolate == nullptr) {
-      std::cerr << "Isolate null" << std::endl;
-      return;
+  ~SpawnHandle() {
+    if (printPort != ILLEGAL_PORT) Dart_CloseNativePort(printPort);
+  }
+};
+
+static std::map<unsigned, std::shared_ptr<SpawnHandle>> spawnHandles;
+static std::map<Dart_Port, std::weak_ptr<SpawnHandle>> printPorts;
+static unsigned nextSpawnId = 1;
+// Finished handles beyond this are forgotten, oldest first.
+static const size_t spawnHandleLimit = 1024;
+static const size_t spawnOutputLimit = 64 * 1024;
+
+// Receives the lines a spawn's isolates print. A null message marks the end
+// of main, messages from one isolate arrive in order so nothing it printed
+// is behind it.
+static void receivePrint(Dart_Port port, Dart_CObject* message) {
+  std::lock_guard<std::mutex> lock(spawnMutex);
+  auto it = printPorts.find(port);
+  if (it == printPorts.end()) return;
+  auto handle = it->second.lock();
+  if (!handle) {
+    printPorts.erase(it);
+    return;
+  }
+
+  if (message->type == Dart_CObject_kNull) {
+    handle->outputClosed = true;
+    return;
+  }
+  if (message->type != Dart_CObject_kString) return;
+
+  string line = message->value.as_string;
+  logMessage(LogSeverity::info, line, handle->port);
+  handle->output += line;
+  handle->output += '\n';
+  if (handle->output.size() > spawnOutputLimit) {
+    auto excess = handle->output.size() - spawnOutputLimit;
+    handle->output.erase(0, excess);
+    handle->outputStart += excess;
+  }
+}
+
+// Sends print in the current isolate to the spawn's print port. The
+// embedder points dart:_internal's _printClosure at its stdout writer, we
+// replace it with the port's SendPort.send.
+static bool capturePrint(Dart_Port printPort, string& message) {
+  auto send = Dart_GetField(Dart_NewSendPort(printPort), Dart_NewStringFromCString("send"));
+  auto internal = Dart_LookupLibrary(Dart_NewStringFromCString("dart:_internal"));
+  auto result = Dart_IsError(send) ? send : Dart_IsError(internal) ? internal :
+    Dart_SetField(internal, Dart_NewStringFromCString("_printClosure"), send);
+
+  if (Dart_IsError(result)) {
+    message = string("Failed to capture print: ") + Dart_GetError(result);
+    return false;
+  }
+  return true;
+}
+
+static bool spawnFinishedState(const SpawnHandle& handle) {
+  return strcmp(handle.state, "done") == 0 || strcmp(handle.state, "failed") == 0;
+}
+
+// Records that one of a spawn's isolates failed. The spawn is only marked
+// failed once all of them are gone. Called with spawnMutex held.
+static void spawnFailed(SpawnHandle& handle, const string& message) {
+  logMessage(LogSeverity::error, message, handle.port);
+  if (handle.error.empty()) handle.error = message;
+}
+
+// Called once one of a spawn's isolates is gone. The last one posts the end
+// marker, which then queues up behind everything any of them printed, and
+// publishes the final state.
+static void isolateFinished(SpawnHandle& handle) {
+  {
+    std::lock_guard<std::mutex> lock(spawnMutex);
+    if (--handle.outstanding > 0) return;
+  }
+
+  Dart_CObject end;
+  end.type = Dart_CObject_kNull;
+  bool ended = handle.printPort != ILLEGAL_PORT && Dart_PostCObject(handle.printPort, &end);
+
+  std::lock_guard<std::mutex> lock(spawnMutex);
+  if (!ended) handle.outputClosed = true;
+  handle.state = handle.error.empty() ? "done" : "failed";
+}
+
+// Tracks a spawn's first isolate, on its worker and then on the thread that
+// runs its main, and publishes its state and phase timings as it goes.
+struct SpawnProgress {
+  explicit SpawnProgress(std::shared_ptr<SpawnHandle> handle) : handle(std::move(handle)) {}
+
+  ~SpawnProgress() {
+    {
+      std::lock_guard<std::mutex> lock(spawnMutex);
+      handle->timer = timer;
+    }
+    isolateFinished(*handle);
+  }
+
+  void enter(const char* state) {
+    std::lock_guard<std::mutex> lock(spawnMutex);
+    handle->state = state;
+    handle->timer = timer;
+  }
+
+  void started(dart::Isolate* isolate) {
+    {
+      std::lock_guard<std::mutex> lock(spawnMutex);
+      handle->isolateName = isolate->name();
+      handle->port = isolate->main_port();
+    }
+
+    string message;
+    if (handle->printPort != ILLEGAL_PORT && !capturePrint(handle->printPort, message)) {
+      logMessage(LogSeverity::warning, message, isolate->main_port());
+    }
+  }
+
+  void fail(const string& message) {
+    std::lock_guard<std::mutex> lock(spawnMutex);
+    spawnFailed(*handle, message);
+  }
+
+  PhaseTimer timer;
+  std::shared_ptr<SpawnHandle> handle;
+};
+
+// Flags that change the kernel Dart_CompileToKernel produces, part of the
+// kernel cache key.
+static const char* compileFlags = "incremental_compile=false";
+
+static string uriPath(const string& uri) {
+  return uri.compare(0, 7, "file://") == 0 ? uri.substr(7) : uri;
+}
+
+static bool isKernelFile(const string& uri) {
+  return uri.size() > 5 && uri.compare(uri.size() - 5, 5, ".dill") == 0;
+}
+
+static bool readScript(const string& uri, string& source) {
+  std::ifstream file(uriPath(uri), std::ios::binary);
+  if (!file) return false;
+  std::ostringstream stream;
+  stream << file.rdbuf();
+  source = stream.str();
+  return true;
+}
+
+// The kernel cache only hashes the root script, or the sources a
+// spawn-source sent along. Anything else it imports could have changed, so
+// such scripts are compiled every time.
+static bool importsOnlyHashed(const string& script, const std::vector<std::pair<string, string>>& sources) {
+  auto hashed = [&](const string& uri) {
+    if (uri.compare(0, 5, "dart:") == 0) return true;
+    return std::any_of(sources.begin(), sources.end(), [&](const std::pair<string, string>& file) {
+      auto& name = file.first;
+      return name == uri || (name.size() > uri.size() && name.compare(name.size() - uri.size(), uri.size(), uri) == 0 &&
+                             name[name.size() - uri.size() - 1] == '/');
+    });
+  };
+
+  auto check = [&](const string& source) {
+    auto uris = directiveUris(source);
+    return std::all_of(uris.begin(), uris.end(), hashed);
+  };
+  if (!script.empty() && !check(script)) return false;
+  return std::all_of(sources.begin(), sources.end(), [&](const std::pair<string, string>& file) {
+    return check(file.second);
+  });
+}
+
+// A command record queued for a spawn worker.
+struct WorkItem : WorkNode {
+  const char* kind;
+  std::function<void()> run;
+  int64_t enqueuedMicros;
+};
+
+struct CommandLatency {
+  uint64_t count = 0;
+  int64_t totalWaitMicros = 0;
+  int64_t maxWaitMicros = 0;
+  int64_t totalRunMicros = 0;
+  int64_t maxRunMicros = 0;
+};
+
+// Long-lived threads that run spawns. Each drains its own lock-free queue, so
+// producers never block and bursts of commands don't start new threads.
+struct SpawnWorker {
+  WorkQueue queue;
+  sem_t wakeup;
+  std::atomic<bool> busy{false};
+  // Set by antmanShutdown along with a post that has no work behind it.
+  std::atomic<bool> stopping{false};
+  // Guarded by enqueueMutex.
+  bool running = false;
+  bool initialized = false;
+};
+
+static const int spawnWorkerCount = 2;
+static SpawnWorker spawnWorkers[spawnWorkerCount];
+// Held while work is queued and while a worker decides to stop, so
+// antmanShutdown sees either the work or its refusal and nothing is queued
+// on a worker that is gone.
+static std::mutex enqueueMutex;
+static std::mutex latencyMutex;
+static std::map<string, CommandLatency> commandLatency;
+
+static void recordLatency(const char* kind, int64_t waitMicros, int64_t runMicros) {
+  std::lock_guard<std::mutex> lock(latencyMutex);
+  auto& latency = commandLatency[kind];
+  latency.count++;
+  latency.totalWaitMicros += waitMicros;
+  latency.maxWaitMicros = std::max(latency.maxWaitMicros, waitMicros);
+  latency.totalRunMicros += runMicros;
+  latency.maxRunMicros = std::max(latency.maxRunMicros, runMicros);
+}
+
+// Starts the workers that aren't running, on first use and again after a
+// failed shutdown. Called with enqueueMutex held.
+static void startSpawnWorkers() {
+  for (auto& worker : spawnWorkers) {
+    if (worker.running) continue;
+    if (!worker.initialized) {
+      sem_init(&worker.wakeup, 0, 0);
+      worker.initialized = true;
+    }
+    worker.running = true;
+
+    startThread("antmanSpawnWorker", [](dart::uword targs) {
+      auto worker = reinterpret_cast<SpawnWorker*>(targs);
+
+      while (true) {
+        if (sem_wait(&worker->wakeup) == -1) continue;
+
+        // Every post matches one push, the node may take a moment to become
+        // visible. Shutdown posts without pushing and sets stopping.
+        WorkNode* node;
+        while ((node = worker->queue.pop()) == nullptr) {
+          if (worker->stopping && worker->queue.size() == 0) break;
+          std::this_thread::yield();
+        }
+
+        if (node == nullptr) {
+          // A shutdown that failed in the meantime leaves the worker running.
+          std::lock_guard<std::mutex> lock(enqueueMutex);
+          worker->stopping = false;
+          if (shuttingDown && worker->queue.size() == 0) {
+            worker->running = false;
+            return;
+          }
+          continue;
+        }
+
+        std::unique_ptr<WorkItem> item(static_cast<WorkItem*>(node));
+        worker->busy = true;
+        auto start = nowMicros();
+        item->run();
+        recordLatency(item->kind, start - item->enqueuedMicros, nowMicros() - start);
+        worker->busy = false;
+      }
+    }, reinterpret_cast<dart::uword>(&worker));
+  }
+}
+
+// Queues a command on the least loaded worker. Returns false without queuing
+// it while antman is shutting down, the caller still owns what run captured.
+static bool enqueueWork(const char* kind, std::function<void()> run) {
+  std::lock_guard<std::mutex> lock(enqueueMutex);
+  if (shuttingDown) {
+    logMessage(LogSeverity::warning, string("Antman is shutting down, refusing ") + kind);
+    return false;
+  }
+
+  startSpawnWorkers();
+
+  auto best = &spawnWorkers[0];
+  int64_t bestLoad = INT64_MAX;
+  for (auto& worker : spawnWorkers) {
+    auto load = worker.queue.size() + (worker.busy ? 1 : 0);
+    if (load < bestLoad) {
+      best = &worker;
+      bestLoad = load;
+    }
+  }
+
+  best->queue.push(new WorkItem{{}, kind, std::move(run), nowMicros()});
+  sem_post(&best->wakeup);
+  return true;
+}
+
+static void writeWorkerInfo(InfoWriter& writer) {
+  int64_t depth = 0;
+  for (auto& worker : spawnWorkers) depth += worker.queue.size();
+
+  writer.beginObject("workers");
+  writer.add("count", spawnWorkerCount);
+  writer.add("queue_depth", depth);
+
+  writer.beginArray("commands");
+  std::lock_guard<std::mutex> lock(latencyMutex);
+  for (auto& entry : commandLatency) {
+    auto& latency = entry.second;
+    writer.beginObject();
+    writer.add("kind", entry.first);
+    writer.add("runs", latency.count);
+    writer.add("wait_avg_us", latency.totalWaitMicros / static_cast<int64_t>(latency.count));
+    writer.add("wait_max_us", latency.maxWaitMicros);
+    writer.add("run_avg_us", latency.totalRunMicros / static_cast<int64_t>(latency.count));
+    writer.add("run_max_us", latency.maxRunMicros);
+    writer.endObject();
+  }
+  writer.endArray();
+  writer.endObject();
+}
+
+// The VM's platform kernel (the core libraries), which isolates are created
+// from. The standalone dart executable links it in, otherwise it is mapped
+// from the SDK next to the executable and stays mapped while antman is
+// loaded, the isolates created from it read it lazily.
+struct PlatformKernel {
+  std::once_flag found;
+  const uint8_t* data = nullptr;
+  intptr_t size = 0;
+  KernelBuffer mapped;
+};
+
+static PlatformKernel platformKernel;
+
+static void findPlatformKernel() {
+  auto data = reinterpret_cast<const uint8_t*>(dlsym(RTLD_DEFAULT, "kPlatformStrongDill"));
+  auto size = reinterpret_cast<const intptr_t*>(dlsym(RTLD_DEFAULT, "kPlatformStrongDillSize"));
+  if (data != nullptr && size != nullptr) {
+    platformKernel.data = data;
+    platformKernel.size = *size;
+    return;
+  }
+
+  char exe[PATH_MAX];
+  auto length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (length <= 0) return;
+  string dir(exe, static_cast<size_t>(length));
+  dir.erase(dir.rfind('/'));
+  platformKernel.mapped = KernelBuffer::mapFile(dir + "/../lib/_internal/vm_platform_strong.dill");
+  if (platformKernel.mapped.empty()) platformKernel.mapped = KernelBuffer::mapFile(dir + "/vm_platform_strong.dill");
+  platformKernel.data = platformKernel.mapped.data;
+  platformKernel.size = platformKernel.mapped.size;
+}
+
+// Creates a runnable isolate with only the core libraries loaded, the
+// script's kernel is loaded into it afterwards. The embedder's create
+// callback isn't used, it would resolve and load the URI itself and spawned
+// URIs often only exist on the injector's side. The builtin, dart:io and
+// dart:cli natives are set up the way the standalone embedder does for its
+// own isolates. The URI is only used as the isolate's name.
+static dart::Isolate* createIsolate(const string& uri, string& message) {
+  std::call_once(platformKernel.found, findPlatformKernel);
+  if (platformKernel.data == nullptr) {
+    message = "Isolate creation error: platform kernel not found";
+    return nullptr;
+  }
+
+  char* error = nullptr;
+  auto isolate = Dart_CreateIsolateFromKernel(uri.c_str(), "main", platformKernel.data, platformKernel.size,
+                                              nullptr, nullptr, &error);
+  if (isolate == nullptr || error != nullptr) {
+    message = string("Isolate creation error: ") + (error ? error : "null isolate");
+    free(error);
+    return nullptr;
+  }
+
+  // Dart_CreateIsolateFromKernel leaves the new isolate entered.
+  Dart_EnterScope();
+  auto result = dart::bin::DartUtils::PrepareForScriptLoading(false, false);
+  if (!Dart_IsError(result)) result = dart::bin::DartUtils::SetupIOLibrary(nullptr, uri.c_str(), true);
+  if (Dart_IsError(result)) {
+    message = string("Isolate setup error: ") + Dart_GetError(result);
+    Dart_ExitScope();
+    Dart_ShutdownIsolate();
+    return nullptr;
+  }
+  Dart_ExitScope();
+  Dart_ExitIsolate();
+
+  auto created = reinterpret_cast<dart::Isolate*>(isolate);
+  created->MakeRunnable();
+  return created;
+}
+
+// Idle, runnable isolates created ahead of time so a spawn only has to load
+// kernel and invoke main. Like any spawn isolate they only have the core
+// libraries loaded, the spawned script's kernel is loaded into them on use.
+struct IsolatePool {
+  std::mutex mutex;
+  std::vector<dart::Isolate*> idle;
+  size_t size = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  bool refilling = false;
+};
+
+static IsolatePool isolatePool;
+static const string poolIsolateName = "antman-pool";
+
+static void refillPool();
+
+// Returns an idle isolate or null when the pool is empty, starts a refill
+// either way.
+static dart::Isolate* takePooledIsolate() {
+  dart::Isolate* isolate = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(isolatePool.mutex);
+    if (isolatePool.size == 0) return nullptr;
+    if (isolatePool.idle.empty()) {
+      isolatePool.misses++;
+    } else {
+      isolate = isolatePool.idle.back();
+      isolatePool.idle.pop_back();
+      isolatePool.hits++;
+    }
+  }
+  refillPool();
+  return isolate;
+}
+
+// Grows or shrinks the pool to its configured size on a background thread.
+static void refillPool() {
+  {
+    std::lock_guard<std::mutex> lock(isolatePool.mutex);
+    if (isolatePool.refilling || isolatePool.idle.size() == isolatePool.size) return;
+    isolatePool.refilling = true;
+  }
+
+  startThread("antmanIsolatePool", [](dart::uword) {
+    while (true) {
+      dart::Isolate* extra = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(isolatePool.mutex);
+        if (isolatePool.idle.size() > isolatePool.size) {
+          extra = isolatePool.idle.back();
+          isolatePool.idle.pop_back();
+        } else if (isolatePool.idle.size() == isolatePool.size) {
+          isolatePool.refilling = false;
+          return;
+        }
+      }
+
+      if (extra != nullptr) {
+        DartIsolateGuard isolateGuard(extra);
+        continue;
+      }
+
+      string message;
+      auto isolate = createIsolate(poolIsolateName, message);
+      if (isolate == nullptr) {
+        logMessage(LogSeverity::error, "Isolate pool: " + message);
+        std::lock_guard<std::mutex> lock(isolatePool.mutex);
+        isolatePool.refilling = false;
+        return;
+      }
+
+      std::lock_guard<std::mutex> lock(isolatePool.mutex);
+      isolatePool.idle.push_back(isolate);
+    }
+  }, 0);
+}
+
+static void setPoolSize(size_t size) {
+  {
+    std::lock_guard<std::mutex> lock(isolatePool.mutex);
+    isolatePool.size = size;
+  }
+  refillPool();
+}
+
+static void writePoolInfo(InfoWriter& writer) {
+  std::lock_guard<std::mutex> lock(isolatePool.mutex);
+  writer.beginObject("pool");
+  writer.add("idle", isolatePool.idle.size());
+  writer.add("size", isolatePool.size);
+  writer.add("hits", isolatePool.hits);
+  writer.add("misses", isolatePool.misses);
+  writer.endObject();
+}
+
+struct SpawnRequest {
+  string uri;
+  // Set when the injector already compiled the script.
+  KernelBuffer kernel;
+  // Set when the injector sent the script and its libraries as source text,
+  // pairs of URI and source compiled from memory.
+  std::vector<std::pair<string, string>> sources;
+  // Number of isolates to run the script in, all loading the same kernel.
+  int instances;
+};
+
+// Takes an isolate from the pool or creates one, returns null with the
+// reason in message on failure.
+static dart::Isolate* acquireIsolate(const string& uriCopy, PhaseTimer::Scope& phase, string& message) {
+  auto isolate = takePooledIsolate();
+
+  if (isolate == nullptr) {
+    phase.next("isolate create", false);
+    isolate = createIsolate(uriCopy, message);
+  }
+
+  return isolate;
+}
+
+// Loads kernel into the current isolate, returns false with the error in
+// message on failure. Progress is null for extra instances.
+static bool loadKernel(const KernelBuffer& kernel, PhaseTimer::Scope& phase, SpawnProgress* progress, string& message) {
+  if (progress != nullptr) progress->enter("loading");
+  phase.next("Dart_LoadLibraryFromKernel", false);
+  auto library = Dart_LoadLibraryFromKernel(kernel.data, kernel.size);
+  phase.finish();
+  if (Dart_IsError(library)) {
+    message = string("Error loading kernel: ") + Dart_GetError(library);
+    return false;
+  }
+  // The isolate was created without a script, the spawned one becomes its root.
+  Dart_SetRootLibrary(library);
+  return true;
+}
+
+// An isolate with its kernel loaded whose main is yet to run.
+struct IsolateRun {
+  dart::Isolate* isolate;
+  // The VM reads the kernel lazily, it has to outlive the isolate.
+  std::shared_ptr<KernelBuffer> kernel;
+  std::shared_ptr<SpawnHandle> handle;
+  // Set for a spawn's first isolate, finishes the spawn's part in it when
+  // destroyed. Extra instances are finished directly.
+  std::unique_ptr<SpawnProgress> progress;
+};
+
+// Runs main on a thread of its own and shuts the isolate down once it
+// returns. Spawn workers only compile and load, so scripts that run for a
+// long time don't keep other spawns and instances waiting.
+static void startMain(IsolateRun* run) {
+  startThread("antmanIsolate", [](dart::uword targs) {
+    std::unique_ptr<IsolateRun> run(reinterpret_cast<IsolateRun*>(targs));
+    PhaseTimer instanceTimer;
+    auto& timer = run->progress ? run->progress->timer : instanceTimer;
+    string message;
+    {
+      DartIsolateGuard isolateGuard(run->isolate);
+      DartScopeGuard scopeGuard;
+      if (run->progress) run->progress->enter("running");
+      auto phase = timer.phase("main");
+      auto res = Dart_Invoke(Dart_RootLibrary(), Dart_NewStringFromCString("main"), 0, nullptr);
+      if (Dart_IsError(res)) message = string("Error running main: ") + Dart_GetError(res);
+    }
+
+    if (!message.empty()) {
+      std::lock_guard<std::mutex> lock(spawnMutex);
+      spawnFailed(*run->handle, message);
+    }
+    if (!run->progress) isolateFinished(*run->handle);
+  }, reinterpret_cast<dart::uword>(run));
+}
+
+struct InstanceRequest {
+  string uri;
+  std::shared_ptr<KernelBuffer> kernel;
+  std::shared_ptr<SpawnHandle> handle;
+};
+
+// Queues one more instance of an already compiled spawn. The kernel is
+// shared, so only the per-isolate state is duplicated. A failing instance
+// fails the whole spawn once all of its isolates are done.
+static void startInstance(const string& uri, const std::shared_ptr<KernelBuffer>& kernel,
+                          const std::shared_ptr<SpawnHandle>& handle) {
+  {
+    std::lock_guard<std::mutex> lock(spawnMutex);
+    handle->outstanding++;
+  }
+
+  InstanceRequest request{uri, kernel, handle};
+  auto queued = enqueueWork("instance", [request] {
+    PhaseTimer timer;
+    string message;
+    {
+      auto phase = timer.phase("isolate pool");
+      auto isolate = acquireIsolate(request.uri, phase, message);
+
+      if (isolate != nullptr) {
+        DartIsolateGuard isolateGuard(isolate);
+        DartScopeGuard scopeGuard;
+        string warning;
+        if (request.handle->printPort != ILLEGAL_PORT && !capturePrint(request.handle->printPort, warning)) {
+          logMessage(LogSeverity::warning, warning, isolate->main_port());
+        }
+        if (loadKernel(*request.kernel, phase, nullptr, message)) {
+          scopeGuard.exit();
+          startMain(new IsolateRun{isolateGuard.release(), request.kernel, request.handle, nullptr});
+          return;
+        }
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(spawnMutex);
+      spawnFailed(*request.handle, message);
+    }
+    isolateFinished(*request.handle);
+  });
+
+  if (!queued) {
+    {
+      std::lock_guard<std::mutex> lock(spawnMutex);
+      spawnFailed(*handle, "Antman is shutting down");
+    }
+    isolateFinished(*handle);
+  }
+}
+
+// Registers a spawn and queues it, returns its id for the status command.
+static unsigned startSpawn(SpawnRequest* request) {
+  auto handle = std::make_shared<SpawnHandle>();
+  handle->uri = request->uri;
+  handle->printPort = Dart_NewNativePort("antman-print", receivePrint, false);
+  {
+    std::lock_guard<std::mutex> lock(spawnMutex);
+    handle->id = nextSpawnId++;
+    handle->outstanding = 1;
+    spawnHandles[handle->id] = handle;
+    if (handle->printPort != ILLEGAL_PORT) printPorts[handle->printPort] = handle;
+
+    for (auto it = spawnHandles.begin(); spawnHandles.size() > spawnHandleLimit && it != spawnHandles.end();) {
+      if (!spawnFinishedState(*it->second)) {
+        ++it;
+        continue;
+      }
+      printPorts.erase(it->second->printPort);
+      it = spawnHandles.erase(it);
     }
+  }
 
-    isolate->MakeRunnable();
+  // std::function needs a copyable callable, the request is owned by the worker.
+  auto queued = enqueueWork("spawn", [request, handle] {
+    std::unique_ptr<SpawnRequest> owner(request);
+    auto& uriCopy = request->uri;
+
+    // Outlives the phase below, so the last phase is timed before it publishes.
+    // Handed to the thread running main along with the isolate.
+    auto progressOwner = std::make_unique<SpawnProgress>(handle);
+    auto& progress = *progressOwner;
+    progress.enter("starting");
+    auto kernelRef = std::make_shared<KernelBuffer>(std::move(request->kernel));
+    auto& kernel = *kernelRef;
+    string message;
+    auto phase = progress.timer.phase("isolate pool");
+    auto isolate = acquireIsolate(uriCopy, phase, message);
+    if (isolate == nullptr) {
+      progress.fail(message);
+      return;
+    }
 
     DartIsolateGuard isolateGuard(isolate);
     DartScopeGuard scopeGuard;
 
     if (!isolate->is_runnable()) {
-      std::cerr << "Isolate not runnable" << std::endl;
+      progress.fail("Isolate not runnable");
       return;
     }
+    progress.started(isolate);
+    progress.enter("compiling");
 
-    auto compile = Dart_CompileToKernel(uriCopy.c_str(), nullptr, 0, false, nullptr);
+    // Precompiled kernels are loaded as they are, without touching the frontend.
+    if (kernel.empty() && isKernelFile(uriCopy)) {
+      phase.next("kernel map", false);
+      kernel = KernelBuffer::mapFile(uriPath(uriCopy));
+      if (kernel.empty()) {
+        progress.fail("Error mapping kernel file: " + uriCopy);
+        return;
+      }
+    }
 
-    if (compile.status != Dart_KernelCompilationStatus_Ok) {
-      if (compile.error) {
-        std::cerr << "Error compiling: " << compile.error << std::endl;
-      } else {
-        std::cerr << "Error compiling: " << compile.status << std::endl;
+    string source, cacheKey;
+    if (kernel.empty()) {
+      phase.next("kernel cache lookup", false);
+      if (!request->sources.empty()) {
+        for (auto& file : request->sources) source += file.first + '\0' + file.second + '\0';
+      } else if (!readScript(uriCopy, source)) {
+        source.clear();
+      }
+
+      if (!source.empty() && importsOnlyHashed(request->sources.empty() ? source : string(), request->sources)) {
+        cacheKey = kernelCacheKey(uriCopy, source, dart::Version::String(), compileFlags);
+        kernel = kernelCacheLookup(cacheKey);
       }
-      return;
     }
 
-    auto library = Dart_LoadLibraryFromKernel(compile.kernel, compile.kernel_size);
+    if (kernel.empty()) {
+      phase.next("Dart_CompileToKernel", false);
+      Dart_KernelCompilationResult compile;
+      if (!request->sources.empty()) {
+        std::vector<Dart_SourceFile> files;
+        for (auto& file : request->sources) files.push_back({file.first.c_str(), file.second.c_str()});
+        compile = Dart_CompileSourcesToKernel(uriCopy.c_str(), nullptr, 0,
+          static_cast<int>(files.size()), files.data(), false, nullptr);
+      } else {
+        compile = Dart_CompileToKernel(uriCopy.c_str(), nullptr, 0, false, nullptr);
+      }
 
-    auto res = Dart_Invoke(library, Dart_NewStringFromCString("main"), 0, nullptr);
+      if (compile.status != Dart_KernelCompilationStatus_Ok) {
+        if (compile.error) {
+          progress.fail(string("Error compiling: ") + compile.error);
+          free(compile.error);
+        } else {
+          progress.fail("Error compiling: " + to_string(compile.status));
+        }
+        return;
+      }
 
-    if (Dart_IsError(res)) {
-      std::cerr << "Error running main: " << Dart_GetError(res) << std::endl;
+      if (!cacheKey.empty()) kernelCacheStore(cacheKey, compile.kernel, compile.kernel_size);
+      kernel = KernelBuffer::adopt(compile.kernel, compile.kernel_size);
+    }
+
+    for (int i = 1; i < request->instances; i++) startInstance(uriCopy, kernelRef, handle);
+
+    if (!loadKernel(kernel, phase, &progress, message)) {
+      progress.fail(message);
       return;
     }
-  }, reinterpret_cast<dart::uword>(uriCopy));
+    scopeGuard.exit();
+    startMain(new IsolateRun{isolateGuard.release(), kernelRef, handle, std::move(progressOwner)});
+  });
+
+  if (!queued) {
+    delete request;
+    {
+      std::lock_guard<std::mutex> lock(spawnMutex);
+      spawnFailed(*handle, "Antman is shutting down");
+    }
+    isolateFinished(*handle);
+  }
+  return handle->id;
+}
+
+extern "C" unsigned antmanSpawn(const char* uri) {
+  return startSpawn(new SpawnRequest{uri, KernelBuffer(), {}, 1});
+}
+
+// Allocates a buffer for the injector to write into, it is handed back to
+// antmanSpawnKernel or antmanRequest which take ownership of it.
+extern "C" void* antmanAlloc(size_t size) {
+  return malloc(size);
+}
+
+extern "C" unsigned antmanSpawnKernel(const char* uri, void* kernel, size_t size, int instances) {
+  auto buffer = KernelBuffer::adopt(reinterpret_cast<uint8_t*>(kernel), static_cast<intptr_t>(size));
+  // Same limits as the control commands, which report them instead.
+  instances = std::max(1, std::min(instances, static_cast<int>(antmanInstancesLimit)));
+  return startSpawn(new SpawnRequest{uri, std::move(buffer), {}, instances});
 }
 
-class AntIsolateVisitor : public dart::IsolateVisitor {
+// One isolate as read without stopping it. The fields are read racily, so
+// they may be slightly inconsistent with each other.
+struct IsolateSample {
+  string name;
+  Dart_Port port;
+  const char* state;
+  int64_t heapNewBytes;
+  int64_t heapOldBytes;
+  bool messagesPending;
+};
+
+// Every isolate, sampled in one pass over the isolate list.
+struct IsolateSnapshot {
+  // Only the first count samples are from the last pass. The rest are kept
+  // from earlier ones so their name strings can be reused.
+  std::vector<IsolateSample> isolates;
+  size_t count = 0;
+  // Isolates beyond snapshotIsolateLimit that were counted but not sampled.
+  size_t skipped = 0;
+  // How long the pass held the VM's isolate list lock, which blocks isolate
+  // creation and shutdown. No isolate is stopped.
+  int64_t passMicros = 0;
+};
+
+static const size_t snapshotIsolateLimit = 4096;
+
+// Copies what it needs out of each isolate without entering a safepoint or
+// scheduling interrupts, so running isolates never notice. Only the
+// message handler's own lock is taken, briefly.
+class SnapshotVisitor : public dart::IsolateVisitor {
 public:
-  explicit AntIsolateVisitor(string* info) : info(info) {}
-  ~AntIsolateVisitor() override = default;
+  explicit SnapshotVisitor(IsolateSnapshot* snapshot) : snapshot(snapshot) {}
+  ~SnapshotVisitor() override = default;
 
   void VisitIsolate(dart::Isolate* isolate) override {
-    isolate->mutator_thread()->EnterSafepoint();
+    if (snapshot->count == snapshotIsolateLimit) {
+      snapshot->skipped++;
+      return;
+    }
+
+    if (snapshot->count == snapshot->isolates.size()) snapshot->isolates.emplace_back();
+    auto& sample = snapshot->isolates[snapshot->count++];
+    sample.name.assign(isolate->name());
+    sample.port = isolate->main_port();
 
-    *info += "Isolate " + to_string(count) + ": " + string(isolate->name()) + "\n";
+    // The mutator thread is only set while a thread has entered the isolate.
+    auto thread = isolate->mutator_thread();
     if (isolate->IsPaused())
-      *info += "  paused\n";
-    else if (isolate->mutator_thread()->IsExecutingDartCode())
-      *info += "  executing\n";
+      sample.state = "paused";
+    else if (thread != nullptr && thread->IsExecutingDartCode())
+      sample.state = "executing";
+    else if (thread != nullptr)
+      sample.state = "running";
     else
-      *info += "  running\n";
-
-    isolate->ScheduleInterrupts();
+      sample.state = "idle";
 
-    isolate->mutator_thread()->ExitSafepoint();
+    auto heap = isolate->heap();
+    sample.heapNewBytes = heap ? heap->UsedInWords(dart::Heap::kNew) * static_cast<int64_t>(sizeof(void*)) : 0;
+    sample.heapOldBytes = heap ? heap->UsedInWords(dart::Heap::kOld) * static_cast<int64_t>(sizeof(void*)) : 0;
 
-    count++;
+    auto handler = isolate->message_handler();
+    sample.messagesPending = handler != nullptr && (handler->HasMessages() || handler->HasOOBMessages());
   }
 
 private:
-  int count = 0;
-  string* info;
+  IsolateSnapshot* snapshot;
 };
 
-const char* antmanInfo() {
-  string info;
+// Samples every isolate. The snapshot's samples are overwritten in place, so
+// callers that keep one around only allocate when an isolate name is longer
+// than any seen at its position before, or there are more isolates.
+static void snapshotIsolates(IsolateSnapshot& snapshot) {
+  snapshot.count = 0;
+  snapshot.skipped = 0;
 
-  info += "Version: " + string(dart::Version::String()) + "\n";
-
-  AntIsolateVisitor visitor(&info);
-  dart::JSONStream stream;
-  dart::Service::PrintJSONForVM(&stream, false);
+  SnapshotVisitor visitor(&snapshot);
+  auto start = nowMicros();
   dart::Isolate::VisitIsolates(&visitor);
+  snapshot.passMicros = nowMicros() - start;
+}
+
+// Reused by every info report so frequent polling doesn't allocate once they
+// have grown. Not thread_local: antmanInfo runs on whichever thread the
+// injector stopped, and thread_local destructors registered on a thread that
+// never exits keep dlclose from unloading us.
+static std::mutex infoMutex;
+static IsolateSnapshot infoSnapshot;
+static string infoArena;
+
+// Writes the info report into out. Called with infoMutex held.
+static void collectInfo(InfoFormat format, string& out) {
+  out.clear();
+  InfoWriter writer(out, format);
+
+  writer.beginObject();
+  writer.add("schema", infoSchemaVersion);
+  writer.add("version", dart::Version::String());
+
+  writePoolInfo(writer);
+  writeWorkerInfo(writer);
+
+  auto& snapshot = infoSnapshot;
+  snapshotIsolates(snapshot);
+
+  writer.beginObject("snapshot");
+  writer.add("safepoint", false);
+  writer.add("pass_us", snapshot.passMicros);
+  writer.add("isolates", snapshot.count + snapshot.skipped);
+  writer.add("skipped", snapshot.skipped);
+  writer.endObject();
+
+  writer.beginArray("isolates");
+  for (size_t i = 0; i < snapshot.count; i++) {
+    auto& sample = snapshot.isolates[i];
+    writer.beginObject();
+    writer.add("index", i);
+    writer.add("name", sample.name);
+    writer.add("port", sample.port);
+    writer.add("state", sample.state);
+    writer.add("heap_new_bytes", sample.heapNewBytes);
+    writer.add("heap_old_bytes", sample.heapOldBytes);
+    writer.add("messages_pending", sample.messagesPending);
+    writer.endObject();
+  }
+  writer.endArray();
+
+  writer.endObject();
+}
+
+// Results for the debugger path go into one memfd mapping that is reused
+// across calls instead of a strdup per result, the injector reads them
+// straight out of our memory.
+struct ResultRegion {
+  std::mutex mutex;
+  int fd = -1;
+  uint8_t* data = nullptr;
+  size_t capacity = 0;
+};
+
+static ResultRegion resultRegion;
+
+// Returns the region holding the result, or null if it can't be mapped.
+static const void* writeResult(bool ok, const string& output) {
+  std::lock_guard<std::mutex> lock(resultRegion.mutex);
+
+  auto needed = sizeof(AntmanResultHeader) + output.size();
+  if (needed > resultRegion.capacity) {
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto capacity = std::max({needed, resultRegion.capacity * 2, antmanResultMinSize});
+    capacity = (capacity + page - 1) / page * page;
+
+    if (resultRegion.fd == -1) resultRegion.fd = memfd_create("antman-results", MFD_CLOEXEC);
+
+    void* map;
+    if (resultRegion.fd != -1 && ftruncate(resultRegion.fd, static_cast<off_t>(capacity)) == 0) {
+      map = resultRegion.data == nullptr
+        ? mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, resultRegion.fd, 0)
+        : mremap(resultRegion.data, resultRegion.capacity, capacity, MREMAP_MAYMOVE);
+    } else {
+      // No memfd, an anonymous mapping reads just as well.
+      map = resultRegion.data == nullptr
+        ? mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+        : mremap(resultRegion.data, resultRegion.capacity, capacity, MREMAP_MAYMOVE);
+    }
+
+    if (map == MAP_FAILED) return nullptr;
+    resultRegion.data = reinterpret_cast<uint8_t*>(map);
+    resultRegion.capacity = capacity;
+  }
+
+  AntmanResultHeader header = {output.size(), ok ? 0u : 1u, 0};
+  memcpy(resultRegion.data, &header, sizeof(header));
+  memcpy(resultRegion.data + sizeof(header), output.data(), output.size());
+  return resultRegion.data;
+}
+
+extern "C" const void* antmanInfo() {
+  std::lock_guard<std::mutex> lock(infoMutex);
+  collectInfo(InfoFormat::text, infoArena);
+  return writeResult(true, infoArena);
+}
+
+// Isolate samples taken by the watch thread at a fixed interval, read by the
+// injector in batches. The oldest rows are dropped if it falls behind.
+struct Watch {
+  std::mutex mutex;
+  bool running = false;
+  // Set by watch-stop, the sampler ends at its next tick.
+  std::atomic<bool> stopping{false};
+  int64_t intervalMicros = 0;
+  int64_t durationMicros = 0;
+  // When the reader last asked for rows.
+  int64_t lastReadMicros = 0;
+  std::deque<WatchRow> rows;
+  // Index of rows[0] among all rows of the current watch.
+  uint64_t rowsStart = 0;
+  // Isolate names by the index of the first row they appear in.
+  std::vector<std::pair<uint64_t, string>> names;
+  std::map<Dart_Port, bool> named;
+};
+
+static Watch watch;
+static const size_t watchRowLimit = 256 * 1024;
+static const size_t watchReadLimit = 64 * 1024;
+// A watch nobody reads for this long is stopped, the reader is gone.
+static const int64_t watchIdleMicros = 10 * 1000000;
+
+static uint8_t watchState(const char* state) {
+  for (uint8_t i = 0; i < sizeof(watchStates) / sizeof(watchStates[0]); i++) {
+    if (strcmp(watchStates[i], state) == 0) return i;
+  }
+  return 0;
+}
+
+static void runWatch(dart::uword) {
+  IsolateSnapshot snapshot;
+  auto next = nowMicros();
+  auto end = next + watch.durationMicros;
+
+  while (!shuttingDown && !watch.stopping && next < end) {
+    snapshotIsolates(snapshot);
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    auto time = static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+
+    {
+      std::lock_guard<std::mutex> lock(watch.mutex);
+      for (size_t i = 0; i < snapshot.count; i++) {
+        auto& sample = snapshot.isolates[i];
+        auto index = watch.rowsStart + watch.rows.size();
+        if (!watch.named[sample.port]) {
+          watch.named[sample.port] = true;
+          auto name = sample.name;
+          std::replace(name.begin(), name.end(), '\n', ' ');
+          watch.names.emplace_back(index, to_string(sample.port) + " " + name);
+        }
+
+        watch.rows.push_back({time, sample.port, sample.heapNewBytes, sample.heapOldBytes,
+          watchState(sample.state), sample.messagesPending, {}});
+        if (watch.rows.size() > watchRowLimit) {
+          watch.rows.pop_front();
+          watch.rowsStart++;
+        }
+      }
+
+      if (nowMicros() - watch.lastReadMicros > watchIdleMicros) {
+        logMessage(LogSeverity::warning, "Stopping watch, nobody read it for " + to_string(watchIdleMicros / 1000000) + " s");
+        break;
+      }
+    }
+
+    // Ticks that were missed because a pass took too long are skipped.
+    next += watch.intervalMicros;
+    for (auto wait = next - nowMicros(); wait > 0 && !shuttingDown && !watch.stopping; wait = next - nowMicros()) {
+      usleep(static_cast<useconds_t>(std::min<int64_t>(wait, 100000)));
+    }
+    if (next < nowMicros()) next = nowMicros();
+  }
+
+  std::lock_guard<std::mutex> lock(watch.mutex);
+  watch.running = false;
+}
+
+static bool startWatch(int64_t intervalMicros, int64_t durationMicros, string& output) {
+  std::lock_guard<std::mutex> lock(watch.mutex);
+  if (watch.running) {
+    output = "A watch is already running";
+    return false;
+  }
+
+  watch.running = true;
+  watch.stopping = false;
+  watch.intervalMicros = intervalMicros;
+  watch.durationMicros = durationMicros;
+  watch.lastReadMicros = nowMicros();
+  watch.rows.clear();
+  watch.rowsStart = 0;
+  watch.names.clear();
+  watch.named.clear();
+  startThread("antmanWatch", runWatch, 0);
+  output = "Watch started";
+  return true;
+}
 
-  return strdup(info.c_str());
-}
\ No newline at end of file
+// Ends the current watch at its next tick, its rows can still be read.
+static bool stopWatch(string& output) {
+  std::lock_guard<std::mutex> lock(watch.mutex);
+  if (!watch.running) {
+    output = "No watch is running";
+    return true;
+  }
+  watch.stopping = true;
+  output = "Watch stopped";
+  return true;
+}
+
+// Returns the rows of the current watch from offset on, at most
+// watchReadLimit of them. The header line has the offset to ask for next,
+// the rows lost because the reader fell behind, whether the watch is over
+// and all rows were read, and the number of "<port> <name>" lines that
+// follow it for isolates first seen in these rows. The rows come last.
+static bool readWatch(uint64_t offset, string& output) {
+  std::lock_guard<std::mutex> lock(watch.mutex);
+  watch.lastReadMicros = nowMicros();
+  auto end = watch.rowsStart + watch.rows.size();
+  auto start = std::min(std::max(offset, watch.rowsStart), end);
+  auto lost = start - std::min(offset, start);
+  auto stop = std::min<uint64_t>(end, start + watchReadLimit);
+
+  // After a loss the reader may have missed names, send them all again.
+  size_t firstName = 0;
+  if (lost == 0) {
+    while (firstName < watch.names.size() && watch.names[firstName].first < start) firstName++;
+  }
+  size_t nameCount = 0;
+  for (auto i = firstName; i < watch.names.size() && watch.names[i].first < stop; i++) nameCount++;
+
+  output = to_string(stop) + " " + to_string(lost) + " " + (!watch.running && stop == end ? "1" : "0") + " " +
+    to_string(nameCount) + "\n";
+  for (auto i = firstName; i < firstName + nameCount; i++) output += watch.names[i].second + "\n";
+
+  output.reserve(output.size() + (stop - start) * sizeof(WatchRow));
+  for (auto i = start; i < stop; i++) {
+    auto& row = watch.rows[i - watch.rowsStart];
+    output.append(reinterpret_cast<const char*>(&row), sizeof(row));
+  }
+  return true;
+}
+
+// Returns whether a spawn is finished on the first line and its phase timings
+// so far after it. Never waits, callers poll until the first line is 1.
+static bool spawnTimings(unsigned id, string& output) {
+  std::lock_guard<std::mutex> lock(spawnMutex);
+  auto it = spawnHandles.find(id);
+  if (it == spawnHandles.end()) {
+    output = "Unknown spawn " + to_string(id);
+    return false;
+  }
+
+  output = spawnFinishedState(*it->second) ? "1\n" : "0\n";
+  output += it->second->timer.serialize();
+  return true;
+}
+
+// Describes a spawn for the status command, fails for unknown ids and for
+// spawns that failed so callers can go by the exit code.
+static bool spawnStatus(unsigned id, string& output) {
+  std::lock_guard<std::mutex> lock(spawnMutex);
+  auto it = spawnHandles.find(id);
+  if (it == spawnHandles.end()) {
+    output = "Unknown spawn " + to_string(id);
+    return false;
+  }
+
+  auto& handle = *it->second;
+  output = "Spawn " + to_string(id) + ": " + handle.state + "\n";
+  output += "URI: " + handle.uri + "\n";
+  if (!handle.isolateName.empty()) output += "Isolate: " + handle.isolateName + " (port " + to_string(handle.port) + ")\n";
+  if (!handle.error.empty()) output += "Error: " + handle.error + "\n";
+  if (!handle.timer.phases.empty()) output += handle.timer.table();
+  if (output.back() == '\n') output.pop_back();
+  return handle.error.empty();
+}
+
+// Returns what a spawn printed from offset on, after a header line with the
+// offset to ask for next, the bytes lost because the buffer was full, the
+// state and whether the spawn is finished and all of its output read.
+static bool spawnOutput(unsigned id, uint64_t offset, string& output) {
+  std::lock_guard<std::mutex> lock(spawnMutex);
+  auto it = spawnHandles.find(id);
+  if (it == spawnHandles.end()) {
+    output = "Unknown spawn " + to_string(id);
+    return false;
+  }
+
+  auto& handle = *it->second;
+  auto end = handle.outputStart + handle.output.size();
+  auto start = std::min(std::max(offset, handle.outputStart), end);
+  bool finished = spawnFinishedState(handle) && handle.outputClosed;
+
+  output = to_string(end) + " " + to_string(start - std::min(offset, start)) + " " + handle.state + " " +
+    (finished ? "1" : "0") + "\n";
+  output.append(handle.output, start - handle.outputStart, string::npos);
+  return true;
+}
+
+// Parses a numeric argument of a command, on failure returns false with the
+// error message in output.
+static bool parseArgument(const string& text, uint64_t min, uint64_t max, const char* what, uint64_t& value,
+                          string& output) {
+  if (control::parseNumber(text, min, max, value)) return true;
+  output = string("Invalid ") + what + " '" + text + "', expected " + to_string(min) + " to " + to_string(max);
+  return false;
+}
+
+// Runs a command received on the control channel, on failure returns false
+// with the error message in output.
+static bool antmanCommand(const std::vector<string>& args, string& output) {
+  if (args.empty()) {
+    output = "Empty command";
+    return false;
+  }
+
+  // Spawn requests are "<command> <uri> <instances> ...", plain spawn may omit the instances.
+  uint64_t instances = 1, number = 0, offset = 0;
+  if (args[0] == "spawn" && (args.size() == 2 || args.size() == 3)) {
+    if (args.size() == 3 && !parseArgument(args[2], 1, antmanInstancesLimit, "instance count", instances, output)) {
+      return false;
+    }
+    output = "Spawn " + to_string(startSpawn(new SpawnRequest{args[1], KernelBuffer(), {}, static_cast<int>(instances)}));
+    return true;
+  } else if (args[0] == "info" && (args.size() == 1 || args.size() == 2)) {
+    auto format = InfoFormat::text;
+    if (args.size() == 2 && !parseInfoFormat(args[1], format)) {
+      output = "Unknown info format '" + args[1] + "'";
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(infoMutex);
+    collectInfo(format, output);
+    return true;
+  } else if (args[0] == "spawn-kernel" && args.size() == 4) {
+    if (!parseArgument(args[3], 0, INT32_MAX, "descriptor", number, output)) return false;
+    // The kernel arrives as a descriptor (usually a memfd), map it instead of copying.
+    int fd = static_cast<int>(number);
+    auto kernel = KernelBuffer::mapFd(fd);
+    close(fd);
+    if (!parseArgument(args[2], 1, antmanInstancesLimit, "instance count", instances, output)) return false;
+    if (kernel.empty()) {
+      output = "Failed to map kernel for '" + args[1] + "'";
+      return false;
+    }
+    auto request = new SpawnRequest{args[1], std::move(kernel), {}, static_cast<int>(instances)};
+    output = "Spawn " + to_string(startSpawn(request));
+    return true;
+  } else if (args[0] == "spawn-source" && args.size() >= 5 && args.size() % 2 == 1) {
+    if (!parseArgument(args[2], 1, antmanInstancesLimit, "instance count", instances, output)) return false;
+    auto request = new SpawnRequest{args[1], KernelBuffer(), {}, static_cast<int>(instances)};
+    for (size_t i = 3; i < args.size(); i += 2) request->sources.emplace_back(args[i], args[i + 1]);
+    output = "Spawn " + to_string(startSpawn(request));
+    return true;
+  } else if (args[0] == "pool" && args.size() == 2) {
+    if (!parseArgument(args[1], 0, antmanPoolSizeLimit, "pool size", number, output)) return false;
+    setPoolSize(number);
+    output = "Isolate pool size set to " + to_string(number);
+    return true;
+  } else if (args[0] == "status" && args.size() == 2) {
+    if (!parseArgument(args[1], 0, UINT32_MAX, "spawn id", number, output)) return false;
+    return spawnStatus(static_cast<unsigned>(number), output);
+  } else if (args[0] == "output" && args.size() == 3) {
+    if (!parseArgument(args[1], 0, UINT32_MAX, "spawn id", number, output) ||
+        !parseArgument(args[2], 0, UINT64_MAX, "offset", offset, output)) {
+      return false;
+    }
+    return spawnOutput(static_cast<unsigned>(number), offset, output);
+  } else if (args[0] == "watch" && args.size() == 3) {
+    uint64_t interval = 0, duration = 0;
+    if (!parseArgument(args[1], antmanWatchIntervalMin, antmanWatchDurationLimit, "watch interval", interval, output) ||
+        !parseArgument(args[2], 1, antmanWatchDurationLimit, "watch duration", duration, output)) {
+      return false;
+    }
+    return startWatch(static_cast<int64_t>(interval), static_cast<int64_t>(duration), output);
+  } else if (args[0] == "watch-stop" && args.size() == 1) {
+    return stopWatch(output);
+  } else if (args[0] == "watch-read" && args.size() == 2) {
+    if (!parseArgument(args[1], 0, UINT64_MAX, "offset", offset, output)) return false;
+    return readWatch(offset, output);
+  } else if (args[0] == "timings" && args.size() == 2) {
+    if (!parseArgument(args[1], 0, UINT32_MAX, "spawn id", number, output)) return false;
+    return spawnTimings(static_cast<unsigned>(number), output);
+  } else if (args[0] == "batch") {
+    std::vector<std::vector<string>> commands;
+    if (!control::decodeBatch(args, commands)) {
+      output = "Malformed batch";
+      return false;
+    }
+
+    // Steps run in order and the batch stops at the first failing one.
+    for (size_t i = 0; i < commands.size(); i++) {
+      auto& command = commands[i];
+      if (command[0] == "batch" || control::carriesFd(command)) {
+        output += "Step " + to_string(i + 1) + " (" + command[0] + "): not allowed in a batch";
+        return false;
+      }
+
+      string stepOutput;
+      bool ok = antmanCommand(command, stepOutput);
+      if (!ok) {
+        output += "Step " + to_string(i + 1) + " (" + command[0] + "): " + stepOutput;
+        return false;
+      }
+      if (!stepOutput.empty()) {
+        output += stepOutput;
+        if (output.back() != '\n') output += '\n';
+      }
+    }
+    if (!output.empty() && output.back() == '\n') output.pop_back();
+    return true;
+  }
+
+  output = "Unknown command '" + args[0] + "'";
+  return false;
+}
+
+// Runs a command on one of antman's threads. Nothing above it would catch an
+// exception, e.g. bad_alloc for a huge peer-supplied length, and letting it
+// escape terminates the target.
+static bool runCommand(const std::vector<string>& args, string& output) {
+  try {
+    return antmanCommand(args, output);
+  } catch (const std::exception& e) {
+    output = string("Command failed: ") + e.what();
+    return false;
+  }
+}
+
+// Runs a serialized control request from a buffer allocated with antmanAlloc,
+// used by injectors going through the debugger. Returns the result region.
+extern "C" const void* antmanRequest(void* buffer, size_t size) {
+  std::vector<string> args;
+  bool decoded = false;
+  try {
+    decoded = control::decodeRequest(reinterpret_cast<const char*>(buffer), size, args);
+  } catch (const std::exception&) {
+  }
+  free(buffer);
+
+  string output;
+  bool ok = decoded && runCommand(args, output);
+  if (!decoded) output = "Malformed request";
+  return writeResult(ok, output);
+}
+
+static int controlSocket = -1;
+static std::atomic<bool> controlRunning{false};
+// Set when antmanShutdown closes the control socket. Whoever clears it again
+// after a failed shutdown, the exiting thread or antmanShutdown, reopens it.
+static std::atomic<bool> controlClosed{false};
+
+static void startControlChannel() {
+  auto name = control::antmanSocketName(getpid());
+  int fd = control::listenSocket(name, true);
+  if (fd == -1) {
+    logMessage(LogSeverity::error, string("Antman control channel unavailable: ") + strerror(errno));
+    return;
+  }
+  controlSocket = fd;
+  controlRunning = true;
+
+  startThread("antmanControl", [](dart::uword targs) {
+    int fd = static_cast<int>(targs);
+
+    while (true) {
+      int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client == -1) {
+        if (shuttingDown || controlClosed) break;
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        logMessage(LogSeverity::error, string("Antman control channel failed: ") + strerror(errno));
+        break;
+      }
+
+      std::vector<string> args;
+      bool received = false;
+      // The control socket is abstract so it has no file permissions.
+      try {
+        received = control::isTrustedPeer(client) && control::setPeerTimeouts(client) &&
+                   control::recvRequest(client, args);
+      } catch (const std::exception&) {
+      }
+      if (received) {
+        string output;
+        bool ok = runCommand(args, output);
+        control::sendResponse(client, ok, output);
+      }
+
+      close(client);
+    }
+
+    close(fd);
+    controlSocket = -1;
+    controlRunning = false;
+    if (!shuttingDown && controlClosed.exchange(false)) startControlChannel();
+  }, static_cast<dart::uword>(fd));
+}
+
+// Work that keeps antmanShutdown from succeeding: queued or running spawns
+// and instances. Called with enqueueMutex held.
+static bool workPending() {
+  for (auto& worker : spawnWorkers) {
+    if (worker.busy || worker.queue.size() > 0) return true;
+  }
+
+  std::lock_guard<std::mutex> lock(spawnMutex);
+  for (auto& entry : spawnHandles) {
+    if (!spawnFinishedState(*entry.second)) return true;
+  }
+  return false;
+}
+
+// Waits up to 5 s for the number of antman's threads to drop to count.
+static bool waitForThreads(int count) {
+  for (int i = 0; i < 5000 && liveThreads > count; i++) usleep(1000);
+
+  // Give the last threads time to leave their entry point after the count drops.
+  usleep(10000);
+  return liveThreads <= count;
+}
+
+// Undoes a shutdown that timed out, antman keeps serving as before.
+static void resumeAfterShutdown(size_t poolSize) {
+  logMessage(LogSeverity::error, "Antman's threads didn't stop in time, it keeps running");
+  {
+    std::lock_guard<std::mutex> lock(enqueueMutex);
+    shuttingDown = false;
+    startSpawnWorkers();
+  }
+  setPoolSize(poolSize);
+  if (!controlRunning && controlClosed.exchange(false)) startControlChannel();
+}
+
+// Stops antman's threads so the injector can unload the library with dlclose
+// and load another version. Returns false and leaves antman running if some
+// are still busy, e.g. a spawn whose main hasn't returned, in which case
+// unloading would crash.
+extern "C" bool antmanShutdown() {
+  {
+    // Work is refused from here on, so none can start after the check.
+    std::lock_guard<std::mutex> lock(enqueueMutex);
+    shuttingDown = true;
+    if (workPending()) {
+      shuttingDown = false;
+      return false;
+    }
+
+    for (auto& worker : spawnWorkers) {
+      if (!worker.running) continue;
+      worker.stopping = true;
+      sem_post(&worker.wakeup);
+    }
+  }
+
+  size_t poolSize;
+  {
+    std::lock_guard<std::mutex> lock(isolatePool.mutex);
+    poolSize = isolatePool.size;
+  }
+  setPoolSize(0);
+
+  // The control channel goes last, it keeps working if anything else is stuck.
+  if (!waitForThreads(controlRunning ? 1 : 0)) {
+    resumeAfterShutdown(poolSize);
+    return false;
+  }
+
+  if (controlRunning) {
+    controlClosed = true;
+    shutdown(controlSocket, SHUT_RDWR);
+  }
+  if (!waitForThreads(0)) {
+    resumeAfterShutdown(poolSize);
+    return false;
+  }
+
+  // The VM calls receivePrint for messages on these ports, close them before
+  // the code goes away.
+  {
+    std::lock_guard<std::mutex> lock(spawnMutex);
+    for (auto& entry : printPorts) {
+      auto handle = entry.second.lock();
+      if (!handle) continue;
+      Dart_CloseNativePort(handle->printPort);
+      handle->printPort = ILLEGAL_PORT;
+    }
+    printPorts.clear();
+    spawnHandles.clear();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(resultRegion.mutex);
+    if (resultRegion.data != nullptr) munmap(resultRegion.data, resultRegion.capacity);
+    if (resultRegion.fd != -1) close(resultRegion.fd);
+    resultRegion.data = nullptr;
+    resultRegion.fd = -1;
+    resultRegion.capacity = 0;
+  }
+
+  // A reloaded antman creates a new ring, don't leave this one for tail to find.
+  if (antmanLog.open) {
+    antmanLog.open = false;
+    munmap(antmanLog.mapping, logRingSize(logRingSlots));
+    close(antmanLog.fd);
+  }
+  return true;
+}
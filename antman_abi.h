@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Exported by libantman as antmanAbiVersion. Bump it whenever an exported
+// function or the control protocol changes incompatibly, the injector
+// reloads an antman whose stamp differs from its own.
+constexpr uint32_t antmanAbi = 7;
+
+// Limits antman enforces on control requests. The injector checks them too,
+// so it can fail before attaching.
+constexpr uint64_t antmanPoolSizeLimit = 64;
+constexpr uint64_t antmanInstancesLimit = 256;
+constexpr uint64_t antmanWatchIntervalMin = 1000;
+constexpr uint64_t antmanWatchDurationLimit = 24ULL * 3600 * 1000000;
+
+// antmanInfo and antmanRequest write their result to a region antman keeps
+// mapped and return its address, the injector reads it out of the target's
+// memory. The header is followed by length bytes of output.
+struct AntmanResultHeader {
+  uint64_t length;
+  // 0 on success, otherwise the output is an error message.
+  uint32_t status;
+  uint32_t reserved;
+};
+
+// The region is never smaller than this, so a reader can fetch the header
+// and a small result with a single read.
+constexpr size_t antmanResultMinSize = 64 * 1024;
+
+// One isolate in one sample of a watch, sent to the injector as raw rows
+// after the watch-read header.
+struct WatchRow {
+  // Wall-clock time of the sample, microseconds since the epoch.
+  int64_t timeMicros;
+  int64_t port;
+  int64_t heapNewBytes;
+  int64_t heapOldBytes;
+  // Index into watchStates.
+  uint8_t state;
+  uint8_t messagesPending;
+  uint8_t reserved[6];
+};
+
+constexpr const char* watchStates[] = {"paused", "executing", "running", "idle"};
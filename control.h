@@ -0,0 +1,286 @@
+#pragma once
+
+// Wire format shared by dart-inject and its control sockets.
+//
+// A request is a list of strings: a u32 count followed by u32-length-prefixed
+// strings. A response is a u32 status (0 = ok) followed by a single
+// u32-length-prefixed body. Integers are in host byte order, both ends always
+// live on the same machine.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+namespace control {
+
+// Name of the abstract socket antman listens on inside the target.
+inline std::string antmanSocketName(int pid) {
+  return "antman-" + std::to_string(pid);
+}
+
+// Parses a whole argument as a decimal number in [min, max]. Unlike stoul it
+// never throws and rejects empty strings, signs and trailing garbage.
+inline bool parseNumber(const std::string& text, uint64_t min, uint64_t max, uint64_t& value) {
+  if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+  errno = 0;
+  auto parsed = strtoull(text.c_str(), nullptr, 10);
+  if (errno == ERANGE || parsed < min || parsed > max) return false;
+  value = parsed;
+  return true;
+}
+
+// Fills in a unix socket address, abstract names get a leading NUL and are
+// not NUL terminated.
+inline socklen_t makeAddress(sockaddr_un& addr, const std::string& name, bool abstract) {
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  auto len = std::min(name.size(), sizeof(addr.sun_path) - 1);
+  memcpy(addr.sun_path + (abstract ? 1 : 0), name.data(), len);
+  if (abstract) return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + len);
+  return sizeof(addr);
+}
+
+// Connects to a unix socket, returns -1 if nobody is listening.
+inline int connectSocket(const std::string& name, bool abstract) {
+  sockaddr_un addr;
+  auto addrLen = makeAddress(addr, name, abstract);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), addrLen) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Binds and listens on a unix socket, returns -1 and leaves errno set on failure.
+inline int listenSocket(const std::string& name, bool abstract) {
+  sockaddr_un addr;
+  auto addrLen = makeAddress(addr, name, abstract);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+  if (!abstract) unlink(name.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), addrLen) == -1 || listen(fd, 16) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+// Credentials of the process at the other end of a connected unix socket.
+inline bool peerCredentials(int fd, ucred& cred) {
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0;
+}
+
+// Peers running as our own user or root.
+inline bool isTrustedPeer(int fd) {
+  ucred cred = {};
+  if (!peerCredentials(fd, cred)) return false;
+  return cred.uid == 0 || cred.uid == getuid();
+}
+
+// Servers handle one client at a time, a client that stops sending or reading
+// only holds them up this long per read or write.
+constexpr int64_t peerTimeoutMicros = 1000000;
+
+inline bool setPeerTimeouts(int fd) {
+  timeval timeout = {static_cast<time_t>(peerTimeoutMicros / 1000000),
+                     static_cast<suseconds_t>(peerTimeoutMicros % 1000000)};
+  return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0;
+}
+
+inline bool writeAll(int fd, const void* data, size_t size) {
+  auto p = reinterpret_cast<const char*>(data);
+  while (size > 0) {
+    auto n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool readAll(int fd, void* data, size_t size) {
+  auto p = reinterpret_cast<char*>(data);
+  while (size > 0) {
+    auto n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool writeString(int fd, const std::string& str) {
+  auto len = static_cast<uint32_t>(str.size());
+  return writeAll(fd, &len, sizeof(len)) && writeAll(fd, str.data(), str.size());
+}
+
+inline bool readString(int fd, std::string& str) {
+  uint32_t len;
+  if (!readAll(fd, &len, sizeof(len))) return false;
+  str.resize(len);
+  return len == 0 || readAll(fd, &str[0], len);
+}
+
+// Sends a file descriptor as SCM_RIGHTS ancillary data on a single byte.
+inline bool sendFd(int socket, int fd) {
+  char byte = 0;
+  iovec iov = {&byte, 1};
+  char buf[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof(buf);
+
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  while (true) {
+    auto n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    return n == 1;
+  }
+}
+
+// Receives a file descriptor sent with sendFd, returns -1 on failure.
+inline int recvFd(int socket) {
+  char byte;
+  iovec iov = {&byte, 1};
+  char buf[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof(buf);
+
+  ssize_t n;
+  do {
+    n = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  if (n != 1) return -1;
+
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+// Commands whose last argument is a file descriptor. The descriptor itself
+// travels as SCM_RIGHTS after the request and the receiver swaps in its own
+// number for it.
+inline bool carriesFd(const std::vector<std::string>& args) {
+  return args.size() == 4 && args[0] == "spawn-kernel";
+}
+
+inline bool sendRequest(int fd, const std::vector<std::string>& args) {
+  auto count = static_cast<uint32_t>(args.size());
+  if (!writeAll(fd, &count, sizeof(count))) return false;
+  for (auto& arg : args) {
+    if (!writeString(fd, arg)) return false;
+  }
+  if (carriesFd(args)) return sendFd(fd, std::stoi(args.back()));
+  return true;
+}
+
+inline bool recvRequest(int fd, std::vector<std::string>& args) {
+  uint32_t count;
+  if (!readAll(fd, &count, sizeof(count))) return false;
+  args.resize(count);
+  for (auto& arg : args) {
+    if (!readString(fd, arg)) return false;
+  }
+  if (carriesFd(args)) {
+    int received = recvFd(fd);
+    if (received == -1) return false;
+    args.back() = std::to_string(received);
+  }
+  return true;
+}
+
+// Serializes a request into a buffer for injectors that can't use a socket
+// and write it into the target's memory instead.
+inline std::string encodeRequest(const std::vector<std::string>& args) {
+  std::string out;
+  auto append = [&](uint32_t value) { out.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+  append(static_cast<uint32_t>(args.size()));
+  for (auto& arg : args) {
+    append(static_cast<uint32_t>(arg.size()));
+    out += arg;
+  }
+  return out;
+}
+
+inline bool decodeRequest(const char* data, size_t size, std::vector<std::string>& args) {
+  size_t pos = 0;
+  auto take = [&](uint32_t& value) {
+    if (size - pos < sizeof(value)) return false;
+    memcpy(&value, data + pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+  };
+
+  uint32_t count;
+  if (!take(count)) return false;
+  args.clear();
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t len;
+    if (!take(len) || size - pos < len) return false;
+    args.emplace_back(data + pos, len);
+    pos += len;
+  }
+  return true;
+}
+
+// A batch is a "batch" request whose arguments are encoded requests, run in
+// order by a single round trip.
+inline std::vector<std::string> encodeBatch(const std::vector<std::vector<std::string>>& commands) {
+  std::vector<std::string> args = {"batch"};
+  for (auto& command : commands) args.push_back(encodeRequest(command));
+  return args;
+}
+
+inline bool decodeBatch(const std::vector<std::string>& args, std::vector<std::vector<std::string>>& commands) {
+  commands.clear();
+  for (size_t i = 1; i < args.size(); i++) {
+    commands.emplace_back();
+    if (!decodeRequest(args[i].data(), args[i].size(), commands.back()) || commands.back().empty()) return false;
+  }
+  return true;
+}
+
+inline bool sendResponse(int fd, bool ok, const std::string& body) {
+  uint32_t status = ok ? 0 : 1;
+  return writeAll(fd, &status, sizeof(status)) && writeString(fd, body);
+}
+
+inline bool recvResponse(int fd, bool& ok, std::string& body) {
+  uint32_t status;
+  if (!readAll(fd, &status, sizeof(status))) return false;
+  ok = status == 0;
+  return readString(fd, body);
+}
+
+}
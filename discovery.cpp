@@ -0,0 +1,235 @@
+#include "discovery.h"
+#include "inject.h"
+#include "proc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string;
+using std::to_string;
+
+namespace {
+
+// What we learned about one mapped file, shared by every process mapping it.
+struct Fingerprint {
+  bool dart = false;
+  string version;
+  string buildId;
+};
+
+struct MappedFile {
+  string dev;
+  uint64_t inode;
+  string path;
+};
+
+// Fingerprints keyed on device and inode, so a binary that hundreds of
+// processes run is only opened once. Threads that want a file somebody else
+// is already looking at wait for that result.
+struct FingerprintCache {
+  std::mutex mutex;
+  std::map<std::pair<string, uint64_t>, std::shared_future<Fingerprint>> files;
+};
+
+}
+
+// Reads a whole /proc file, they don't report a size. Returns false if the
+// process is gone or we may not read it.
+static bool readProcFile(const string& path, string& content) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  content.clear();
+  char buffer[65536];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) content.append(buffer, static_cast<size_t>(n));
+  close(fd);
+  return n == 0;
+}
+
+// Picks the executable file mappings out of /proc/<pid>/maps. This is on the
+// hot path for every process, so it doesn't go through readMaps.
+static std::vector<MappedFile> executableFiles(const string& maps, bool& antmanLoaded) {
+  std::vector<MappedFile> files;
+  antmanLoaded = false;
+
+  size_t pos = 0;
+  while (pos < maps.size()) {
+    auto end = maps.find('\n', pos);
+    if (end == string::npos) end = maps.size();
+    auto line = maps.c_str() + pos;
+    auto lineEnd = maps.c_str() + end;
+    pos = end + 1;
+
+    // start-end perms offset dev inode path
+    auto perms = static_cast<const char*>(memchr(line, ' ', lineEnd - line));
+    if (perms == nullptr || lineEnd - perms < 5) continue;
+    perms++;
+
+    auto offset = perms + 5;
+    auto dev = static_cast<const char*>(memchr(offset, ' ', lineEnd - offset));
+    if (dev == nullptr) continue;
+    dev++;
+    auto inodeStart = static_cast<const char*>(memchr(dev, ' ', lineEnd - dev));
+    if (inodeStart == nullptr) continue;
+
+    char* inodeEnd;
+    auto inode = strtoull(inodeStart + 1, &inodeEnd, 10);
+    const char* pathStart = inodeEnd;
+    while (pathStart < lineEnd && *pathStart == ' ') pathStart++;
+    if (inode == 0 || pathStart == lineEnd || *pathStart != '/') continue;
+
+    string path(pathStart, lineEnd);
+    auto slash = path.rfind('/');
+    if (path.compare(slash + 1, 9, "libantman") == 0) antmanLoaded = true;
+
+    if (perms[2] != 'x') continue;
+    if (!files.empty() && files.back().inode == inode && files.back().path == path) continue;
+    files.push_back({string(dev, inodeStart), inode, std::move(path)});
+  }
+
+  return files;
+}
+
+// Dart's version string looks like `2.0.0 (Fri Aug 3 10:53:23 2018 +0200) on "linux_x64"`.
+static string findVersionString(const uint8_t* data, size_t size) {
+  static const char marker[] = ") on \"";
+  auto begin = reinterpret_cast<const char*>(data);
+  auto end = begin + size;
+
+  for (auto pos = begin; pos < end; pos++) {
+    pos = static_cast<const char*>(memmem(pos, end - pos, marker, sizeof(marker) - 1));
+    if (pos == nullptr) break;
+
+    auto start = pos;
+    while (start > begin && start[-1] != '\0' && pos - start < 128) start--;
+    if (start != begin && start[-1] != '\0') continue;
+    if (!isdigit(static_cast<unsigned char>(*start))) continue;
+
+    auto stop = static_cast<const char*>(memchr(pos, '\0', end - pos));
+    if (stop != nullptr && stop - pos < 64) return string(start, stop);
+  }
+  return "";
+}
+
+static bool mentionsDart(const string& path) {
+  return path.find("dart") != string::npos || path.find("flutter") != string::npos;
+}
+
+// System libraries never embed the VM, skip them unless the path says otherwise.
+static bool isSystemPath(const string& path) {
+  for (auto prefix : {"/lib/", "/lib64/", "/usr/lib/", "/usr/lib64/", "/bin/", "/sbin/", "/usr/bin/", "/usr/sbin/"}) {
+    if (path.compare(0, strlen(prefix), prefix) == 0) return true;
+  }
+  return false;
+}
+
+// A file embeds the VM if it defines the embedding API. Stripped embedders
+// whose path mentions dart or flutter are accepted if they carry the VM's
+// version string.
+static Fingerprint fingerprint(int pid, const string& path) {
+  Fingerprint result;
+  if (isSystemPath(path) && !mentionsDart(path)) return result;
+
+  try {
+    ElfFile elf(targetPath(pid, path));
+
+    uint64_t value;
+    result.dart = elf.findSymbol("Dart_Initialize", value);
+    if (!result.dart && !mentionsDart(path)) return result;
+
+    result.version = findVersionString(elf.data, elf.size);
+    result.dart = result.dart || !result.version.empty();
+    if (result.dart) result.buildId = elf.buildId();
+  } catch (const InjectionError&) {
+    // Deleted, unreadable or not an ELF file.
+  }
+  return result;
+}
+
+static Fingerprint cachedFingerprint(FingerprintCache& cache, int pid, const MappedFile& file) {
+  std::promise<Fingerprint> promise;
+  std::shared_future<Fingerprint> future;
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto& entry = cache.files[{file.dev, file.inode}];
+    if (entry.valid()) {
+      future = entry;
+    } else {
+      entry = promise.get_future().share();
+    }
+  }
+
+  if (future.valid()) return future.get();
+
+  // Threads waiting on the same file get whatever fingerprint threw, e.g.
+  // bad_alloc, instead of a broken promise.
+  Fingerprint result;
+  try {
+    result = fingerprint(pid, file.path);
+  } catch (...) {
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+  promise.set_value(result);
+  return result;
+}
+
+static bool inspectProcess(FingerprintCache& cache, int pid, DartProcess& process) {
+  string maps;
+  if (!readProcFile("/proc/" + to_string(pid) + "/maps", maps)) return false;
+
+  bool antmanLoaded;
+  for (auto& file : executableFiles(maps, antmanLoaded)) {
+    Fingerprint print;
+    try {
+      print = cachedFingerprint(cache, pid, file);
+    } catch (const std::exception&) {
+      // Escaping a discovery thread would terminate us, skip the file instead.
+      continue;
+    }
+    if (!print.dart) continue;
+
+    process = {pid, processName(pid), file.path, print.version, print.buildId, antmanLoaded};
+    return true;
+  }
+  return false;
+}
+
+std::vector<DartProcess> discoverDartProcesses() {
+  auto pids = listProcesses();
+
+  FingerprintCache cache;
+  std::mutex resultsMutex;
+  std::vector<DartProcess> results;
+  std::atomic<size_t> nextPid(0);
+
+  auto worker = [&] {
+    std::vector<DartProcess> found;
+    for (size_t i; (i = nextPid++) < pids.size();) {
+      DartProcess process;
+      if (inspectProcess(cache, pids[i], process)) found.push_back(std::move(process));
+    }
+
+    std::lock_guard<std::mutex> lock(resultsMutex);
+    for (auto& process : found) results.push_back(std::move(process));
+  };
+
+  auto threadCount = std::max(1u, std::min(std::thread::hardware_concurrency(), 16u));
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < threadCount; i++) threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads) thread.join();
+
+  std::sort(results.begin(), results.end(), [](const DartProcess& a, const DartProcess& b) { return a.pid < b.pid; });
+  return results;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A running process that embeds the Dart VM.
+struct DartProcess {
+  int pid;
+  std::string name;
+
+  // The executable or library that contains the VM, as seen by the process.
+  std::string module;
+  std::string version;
+  std::string buildId;
+  bool antmanLoaded;
+};
+
+// Scans /proc from a few threads and returns every process with the Dart VM
+// mapped, sorted by pid. Works for embedders that aren't named dart (Flutter
+// engines, AOT runtimes) since it looks at the mapped files rather than the
+// process name. Processes we can't read are skipped.
+std::vector<DartProcess> discoverDartProcesses();
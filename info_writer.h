@@ -0,0 +1,268 @@
+#pragma once
+
+// Streaming writer for antman's info report. Fields are appended straight to
+// one output buffer in the requested encoding, there is no intermediate tree
+// and no per-field string. msgpack containers get 32-bit headers whose
+// counts are patched in when they are closed, so callers don't have to know
+// them up front.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Bumped whenever a field of the report is renamed, removed or changes meaning.
+constexpr int infoSchemaVersion = 2;
+
+enum class InfoFormat { text, json, msgpack };
+
+inline bool parseInfoFormat(const std::string& name, InfoFormat& format) {
+  if (name == "text") {
+    format = InfoFormat::text;
+  } else if (name == "json") {
+    format = InfoFormat::json;
+  } else if (name == "msgpack") {
+    format = InfoFormat::msgpack;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+class InfoWriter {
+public:
+  InfoWriter(std::string& out, InfoFormat format) : out(out), format(format) {
+    stack.reserve(8);
+  }
+
+  // Containers take the key they are stored under, none at the top level or
+  // inside arrays. Text is indented "key: value" lines, array items start with "- ".
+  void beginObject(const char* key = nullptr) {
+    open(key, false);
+  }
+
+  void endObject() {
+    close();
+  }
+
+  void beginArray(const char* key = nullptr) {
+    open(key, true);
+  }
+
+  void endArray() {
+    close();
+  }
+
+  template <typename T, typename = typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+  void add(const char* key, T value) {
+    addInteger(key, static_cast<int64_t>(value));
+  }
+
+  void add(const char* key, bool value) {
+    element(key);
+    switch (format) {
+      case InfoFormat::text: out += value ? "true\n" : "false\n"; break;
+      case InfoFormat::json: out += value ? "true" : "false"; break;
+      case InfoFormat::msgpack: out += static_cast<char>(value ? 0xc3 : 0xc2); break;
+    }
+  }
+
+  void add(const char* key, const char* value) {
+    addString(key, value, strlen(value));
+  }
+
+  void add(const char* key, const std::string& value) {
+    addString(key, value.data(), value.size());
+  }
+
+private:
+  struct Level {
+    bool array;
+    uint32_t count;
+    size_t header;
+  };
+
+  void addInteger(const char* key, int64_t value) {
+    element(key);
+    if (format != InfoFormat::msgpack) {
+      char digits[24];
+      auto length = integerText(value, digits);
+      out.append(digits, length);
+      if (format == InfoFormat::text) out += '\n';
+    } else if (value >= 0 && value < 128) {
+      out += static_cast<char>(value);
+    } else if (value < 0 && value >= -32) {
+      out += static_cast<char>(0xe0 | (value + 32));
+    } else {
+      out += static_cast<char>(0xd3);
+      bigEndian(static_cast<uint64_t>(value), 8);
+    }
+  }
+
+  void addString(const char* key, const char* value, size_t length) {
+    element(key);
+    switch (format) {
+      case InfoFormat::text:
+        out.append(value, length);
+        out += '\n';
+        break;
+      case InfoFormat::json:
+        jsonString(value, length);
+        break;
+      case InfoFormat::msgpack:
+        msgpackString(value, length);
+        break;
+    }
+  }
+
+  // Writes what goes before a value: separators and the key, or the dash of
+  // an array item.
+  void element(const char* key) {
+    if (stack.empty()) return;
+    auto& level = stack.back();
+
+    switch (format) {
+      case InfoFormat::text:
+        indent();
+        if (level.array) {
+          out += "- ";
+        } else {
+          out += key;
+          out += ": ";
+        }
+        break;
+      case InfoFormat::json:
+        if (level.count > 0) out += ',';
+        if (!level.array) {
+          jsonString(key, strlen(key));
+          out += ':';
+        }
+        break;
+      case InfoFormat::msgpack:
+        if (!level.array) msgpackString(key, strlen(key));
+        break;
+    }
+    level.count++;
+  }
+
+  void open(const char* key, bool array) {
+    bool nested = !stack.empty();
+    if (nested && format == InfoFormat::text) {
+      // Containers go on the lines below their key, an object in an array
+      // puts the dash on its first line.
+      bool inArray = stack.back().array;
+      if (!inArray) {
+        indent();
+        out += key;
+        out += ":\n";
+      }
+      stack.back().count++;
+      stack.push_back({array, 0, 0});
+      dash = inArray && !array;
+      return;
+    }
+
+    if (nested) element(key);
+    switch (format) {
+      case InfoFormat::text:
+        break;
+      case InfoFormat::json:
+        out += array ? '[' : '{';
+        break;
+      case InfoFormat::msgpack:
+        out += static_cast<char>(array ? 0xdd : 0xdf);
+        bigEndian(0, 4);
+        break;
+    }
+    stack.push_back({array, 0, format == InfoFormat::msgpack ? out.size() - 5 : 0});
+  }
+
+  void close() {
+    auto level = stack.back();
+    stack.pop_back();
+    dash = false;
+
+    switch (format) {
+      case InfoFormat::text:
+        break;
+      case InfoFormat::json:
+        out += level.array ? ']' : '}';
+        break;
+      case InfoFormat::msgpack:
+        for (int i = 0; i < 4; i++) out[level.header + 1 + i] = static_cast<char>(level.count >> (24 - 8 * i));
+        break;
+    }
+  }
+
+  // Text lines are indented by the depth below the top level object.
+  void indent() {
+    auto width = 2 * (stack.size() - 1);
+    if (dash) {
+      out.append(width - 2, ' ');
+      out += "- ";
+      dash = false;
+    } else {
+      out.append(width, ' ');
+    }
+  }
+
+  void bigEndian(uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) out += static_cast<char>(value >> (8 * i));
+  }
+
+  void msgpackString(const char* value, size_t length) {
+    if (length < 32) {
+      out += static_cast<char>(0xa0 | length);
+    } else if (length < 0x100) {
+      out += static_cast<char>(0xd9);
+      bigEndian(length, 1);
+    } else if (length < 0x10000) {
+      out += static_cast<char>(0xda);
+      bigEndian(length, 2);
+    } else {
+      out += static_cast<char>(0xdb);
+      bigEndian(length, 4);
+    }
+    out.append(value, length);
+  }
+
+  void jsonString(const char* value, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    out += '"';
+    for (size_t i = 0; i < length; i++) {
+      auto c = static_cast<unsigned char>(value[i]);
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += static_cast<char>(c);
+      } else if (c < 0x20) {
+        out += "\\u00";
+        out += digits[c >> 4];
+        out += digits[c & 0xf];
+      } else {
+        out += static_cast<char>(c);
+      }
+    }
+    out += '"';
+  }
+
+  static size_t integerText(int64_t value, char* buffer) {
+    char reversed[24];
+    size_t length = 0;
+    auto magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do {
+      reversed[length++] = static_cast<char>('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude != 0);
+
+    size_t pos = 0;
+    if (value < 0) buffer[pos++] = '-';
+    while (length > 0) buffer[pos++] = reversed[--length];
+    return pos;
+  }
+
+  std::string& out;
+  InfoFormat format;
+  std::vector<Level> stack;
+  bool dash = false;
+};
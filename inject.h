@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <exception>
+
+struct InjectionError : std::exception {
+  explicit InjectionError(std::string what) : what(std::move(what)) {}
+  std::string what;
+};
+
+extern bool verbose;
@@ -0,0 +1,152 @@
+#include "kernel_cache.h"
+#include "sha256.h"
+#include "control.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using std::string;
+
+KernelBuffer::~KernelBuffer() {
+  if (data == nullptr) return;
+  if (mapped) {
+    munmap(const_cast<uint8_t*>(data), static_cast<size_t>(size));
+  } else {
+    free(const_cast<uint8_t*>(data));
+  }
+}
+
+KernelBuffer::KernelBuffer(KernelBuffer&& other) noexcept :
+  data(other.data), size(other.size), mapped(other.mapped) {
+  other.data = nullptr;
+  other.size = 0;
+}
+
+KernelBuffer& KernelBuffer::operator=(KernelBuffer&& other) noexcept {
+  if (this != &other) {
+    this->~KernelBuffer();
+    data = other.data;
+    size = other.size;
+    mapped = other.mapped;
+    other.data = nullptr;
+    other.size = 0;
+  }
+  return *this;
+}
+
+KernelBuffer KernelBuffer::adopt(uint8_t* data, intptr_t size) {
+  KernelBuffer buffer;
+  buffer.data = data;
+  buffer.size = size;
+  return buffer;
+}
+
+KernelBuffer KernelBuffer::mapFile(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return KernelBuffer();
+
+  auto buffer = mapFd(fd);
+  close(fd);
+  return buffer;
+}
+
+KernelBuffer KernelBuffer::mapFd(int fd) {
+  KernelBuffer buffer;
+  struct stat st = {};
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      buffer.data = reinterpret_cast<const uint8_t*>(map);
+      buffer.size = st.st_size;
+      buffer.mapped = true;
+    }
+  }
+  return buffer;
+}
+
+// The cache directory is shared by every process of the user, refuse to use
+// one that somebody else could have planted kernels in.
+static bool cacheDirectory(string& dir) {
+  auto env = getenv("ANTMAN_KERNEL_CACHE");
+  dir = env != nullptr && env[0] != '\0' ? env : "/tmp/antman-kernel-cache-" + std::to_string(geteuid());
+
+  mkdir(dir.c_str(), 0700);
+
+  struct stat st = {};
+  if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+  return st.st_uid == geteuid() && (st.st_mode & 0022) == 0;
+}
+
+string kernelCacheKey(const string& uri, const string& source, const string& version, const string& flags) {
+  Sha256 hash;
+  hash.update(uri);
+  hash.update("\0", 1);
+  hash.update(source);
+  hash.update("\0", 1);
+  hash.update(version);
+  hash.update("\0", 1);
+  hash.update(flags);
+  return hash.hex();
+}
+
+std::vector<string> directiveUris(const string& source) {
+  std::vector<string> uris;
+  bool directive = false;
+  size_t i = 0;
+  auto size = source.size();
+
+  while (i < size) {
+    auto c = source[i];
+    if (source.compare(i, 2, "//") == 0) {
+      i = source.find('\n', i);
+    } else if (source.compare(i, 2, "/*") == 0) {
+      auto end = source.find("*/", i + 2);
+      i = end == string::npos ? end : end + 2;
+    } else if (c == '\'' || c == '"') {
+      string quote(source.compare(i, 3, string(3, c)) == 0 ? 3 : 1, c);
+      auto start = i + quote.size();
+      auto end = start;
+      while (end < size && source.compare(end, quote.size(), quote) != 0) end += source[end] == '\\' ? 2 : 1;
+      if (directive) uris.push_back(source.substr(start, std::min(end, size) - start));
+      i = end + quote.size();
+    } else if (isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$') {
+      auto end = i;
+      while (end < size && (isalnum(static_cast<unsigned char>(source[end])) || source[end] == '_' || source[end] == '$')) end++;
+      auto word = source.compare(i, end - i, "import") == 0 || source.compare(i, end - i, "export") == 0 ||
+        source.compare(i, end - i, "part") == 0;
+      if (word) directive = true;
+      i = end;
+    } else {
+      if (c == ';') directive = false;
+      i++;
+    }
+  }
+  return uris;
+}
+
+KernelBuffer kernelCacheLookup(const string& key) {
+  string dir;
+  if (!cacheDirectory(dir)) return KernelBuffer();
+  return KernelBuffer::mapFile(dir + "/" + key + ".dill");
+}
+
+void kernelCacheStore(const string& key, const uint8_t* data, intptr_t size) {
+  string dir;
+  if (!cacheDirectory(dir)) return;
+
+  // Write to a private temporary and rename so readers never see a partial blob.
+  auto path = dir + "/" + key + ".dill";
+  auto tmpPath = path + ".XXXXXX";
+  int fd = mkostemp(&tmpPath[0], O_CLOEXEC);
+  if (fd == -1) return;
+
+  bool ok = control::writeAll(fd, data, static_cast<size_t>(size));
+  close(fd);
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) unlink(tmpPath.c_str());
+}
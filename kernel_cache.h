@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Kernel bytes handed to Dart_LoadLibraryFromKernel, either mapped from a
+// file or adopted from a malloc'd compiler result. The VM reads from the
+// buffer lazily so it has to outlive the isolate that loaded it.
+struct KernelBuffer {
+  KernelBuffer() = default;
+  ~KernelBuffer();
+
+  KernelBuffer(KernelBuffer&& other) noexcept;
+  KernelBuffer& operator=(KernelBuffer&& other) noexcept;
+
+  static KernelBuffer adopt(uint8_t* data, intptr_t size);
+
+  // Maps a whole file read-only, returns an empty buffer on failure.
+  static KernelBuffer mapFile(const std::string& path);
+
+  // Same as mapFile for an open descriptor, which is left open.
+  static KernelBuffer mapFd(int fd);
+
+  bool empty() const {
+    return data == nullptr;
+  }
+
+  const uint8_t* data = nullptr;
+  intptr_t size = 0;
+
+private:
+  bool mapped = false;
+};
+
+// Content-addressed cache of compiled kernel blobs. The key covers the script's
+// resolved URI and source, the VM version and the compile flags. Imported
+// files are not hashed, callers only cache scripts whose directiveUris are all
+// dart: libraries or sources they hashed themselves.
+std::string kernelCacheKey(const std::string& uri, const std::string& source, const std::string& version,
+                           const std::string& flags);
+
+// URIs named by the import, export and part directives of a Dart source,
+// including the alternatives of conditional imports. Errs on the side of
+// returning too many: any string literal between one of those words and the
+// next ';' is taken.
+std::vector<std::string> directiveUris(const std::string& source);
+
+// Maps a cached kernel blob, returns an empty buffer on a miss.
+KernelBuffer kernelCacheLookup(const std::string& key);
+
+void kernelCacheStore(const std::string& key, const uint8_t* data, intptr_t size);
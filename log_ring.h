@@ -0,0 +1,133 @@
+#pragma once
+
+// antman's log, a ring of fixed size records in a memfd. Every antman thread
+// appends to it without locks and dart-inject reads it through the memfd's
+// /proc/<pid>/fd entry, without attaching or writing to the target's stdout.
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+constexpr uint32_t logRingMagic = 0x676f6c61;
+constexpr uint32_t logRingVersion = 1;
+constexpr const char* logRingName = "antman-log";
+constexpr uint32_t logRingSlots = 4096;
+
+enum class LogSeverity : uint32_t { info, warning, error };
+
+inline const char* severityName(uint32_t severity) {
+  switch (static_cast<LogSeverity>(severity)) {
+    case LogSeverity::info: return "INFO";
+    case LogSeverity::warning: return "WARN";
+    case LogSeverity::error: return "ERROR";
+  }
+  return "?";
+}
+
+struct LogRecord {
+  // 2 * index + 1 while record index is written, 2 * index + 2 once it is
+  // complete. Readers check it before and after copying the record.
+  std::atomic<uint64_t> sequence;
+  // Wall-clock time, microseconds since the epoch.
+  int64_t timeMicros;
+  // Main port of the isolate the record is about, 0 for antman itself.
+  int64_t isolate;
+  uint32_t severity;
+  uint32_t length;
+  // Longer messages are truncated.
+  char text[224];
+};
+
+struct LogRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slotCount;
+  uint32_t slotSize;
+  // Index of the next record to write.
+  std::atomic<uint64_t> head;
+  // Records a writer gave up on because their slot was still being written.
+  std::atomic<uint64_t> dropped;
+  uint8_t reserved[32];
+};
+
+static_assert(sizeof(LogRecord) == 256 && sizeof(LogRingHeader) == 64, "log ring layout changed");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the log ring is shared between processes");
+
+constexpr size_t logRingSize(uint32_t slots) {
+  return sizeof(LogRingHeader) + slots * sizeof(LogRecord);
+}
+
+struct LogRing {
+  LogRingHeader* header = nullptr;
+  LogRecord* records = nullptr;
+
+  // Points the ring at a mapping of logRingSize bytes, initializes it if
+  // create is set. Returns false if an existing mapping isn't a log ring.
+  bool attach(void* mapping, size_t size, bool create) {
+    auto ring = static_cast<LogRingHeader*>(mapping);
+    if (create) {
+      memset(mapping, 0, size);
+      ring->magic = logRingMagic;
+      ring->version = logRingVersion;
+      ring->slotSize = sizeof(LogRecord);
+      ring->slotCount = static_cast<uint32_t>((size - sizeof(LogRingHeader)) / sizeof(LogRecord));
+    } else if (size < sizeof(LogRingHeader) || ring->magic != logRingMagic || ring->version != logRingVersion ||
+               ring->slotSize != sizeof(LogRecord) || logRingSize(ring->slotCount) > size) {
+      return false;
+    }
+
+    header = ring;
+    records = reinterpret_cast<LogRecord*>(static_cast<uint8_t*>(mapping) + sizeof(LogRingHeader));
+    return true;
+  }
+
+  // Appends a record, never blocks. Once the ring is full the oldest records
+  // are overwritten. A record whose slot is still being written by a writer
+  // a whole lap behind is dropped and counted instead.
+  void write(LogSeverity severity, int64_t isolate, const char* text, size_t length) {
+    auto index = header->head.fetch_add(1, std::memory_order_relaxed);
+    auto& slot = records[index % header->slotCount];
+    auto writing = 2 * index + 1;
+
+    auto current = slot.sequence.load(std::memory_order_relaxed);
+    if ((current & 1) != 0 || current >= writing ||
+        !slot.sequence.compare_exchange_strong(current, writing, std::memory_order_acq_rel)) {
+      header->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot.timeMicros = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    slot.isolate = isolate;
+    slot.severity = static_cast<uint32_t>(severity);
+    slot.length = static_cast<uint32_t>(length < sizeof(slot.text) ? length : sizeof(slot.text));
+    memcpy(slot.text, text, slot.length);
+
+    slot.sequence.store(writing + 1, std::memory_order_release);
+  }
+
+  enum class ReadResult { ok, pending, overwritten };
+
+  // Copies record index if it is complete. Pending records are still being
+  // written (or were dropped), overwritten ones are lost to the reader.
+  ReadResult read(uint64_t index, LogRecord& record) const {
+    auto& slot = records[index % header->slotCount];
+    auto complete = 2 * index + 2;
+
+    auto before = slot.sequence.load(std::memory_order_acquire);
+    if (before < complete) return ReadResult::pending;
+    if (before > complete) return ReadResult::overwritten;
+
+    record.timeMicros = slot.timeMicros;
+    record.isolate = slot.isolate;
+    record.severity = slot.severity;
+    record.length = slot.length < sizeof(record.text) ? slot.length : sizeof(record.text);
+    memcpy(record.text, slot.text, record.length);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == complete ? ReadResult::ok : ReadResult::overwritten;
+  }
+};
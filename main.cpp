@@ -5,8 +5,32 @@
 
 #include <dirent.h>
 #include <fstream>
+#include <iomanip>
+#include <sstream>
 #include <zconf.h>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <regex>
+#include <thread>
 #include "cxxopts.hpp"
+#include "antman_abi.h"
+#include "control.h"
+#include "discovery.h"
+#include "info_writer.h"
+#include "log_ring.h"
+#include "inject.h"
+#include "proc.h"
+#include "ptrace_loader.h"
+#include "timing.h"
 
 using std::cerr;
 using std::cout;
@@ -14,18 +38,10 @@ using std::endl;
 using std::string;
 using std::to_string;
 
-static bool verbose = false;
-
-struct InjectionError : std::exception {
-  explicit InjectionError(string what) : what(std::move(what)) {}
-  string what;
-};
+bool verbose = false;
 
 void assertSBErr(lldb::SBError& err) {
-  if (err.Fail()) {
-    cerr << "Error: " << err.GetCString() << endl;
-    exit(1);
-  }
+  if (err.Fail()) throw InjectionError(err.GetCString());
 }
 
 struct antmanInjector {
@@ -56,10 +72,7 @@ struct antmanInjector {
   lldb::SBValue expr(const char* cmd) {
     if (verbose) cout << "Evaluating expr: " << cmd << endl;
     auto val = target.EvaluateExpression(cmd);
-    if (!val.IsValid()) {
-      cerr << "Error: Expression not valid: " << val.GetError().GetCString() << endl;
-      exit(1);
-    }
+    if (!val.IsValid()) throw InjectionError(string("Expression not valid: ") + val.GetError().GetCString());
     return val;
   }
 
@@ -77,30 +90,1347 @@ struct antmanInjector {
     return o;
   }
 
-  std::string strExpr(const char* cmd) {
-    auto str = sizeExpr(cmd);
-    auto strPtr = string(to_string(str));
-    auto len = sizeExpr(("(size_t)strlen(" + strPtr + ")").c_str());
-    auto o = std::string();
-    o.resize(len);
+  void updateTarget() {
+    target = debugger.GetSelectedTarget();
+    process = target.GetProcess();
+  }
+
+  void attach(int pid) {
+    runCmd("process attach -p " + to_string(pid));
+    updateTarget();
+  }
+
+  // Makes lldb parse the symbol tables of the target up front, otherwise it
+  // happens inside the first expression. Direct calls resolve symbols
+  // themselves and don't need them.
+  void loadSymbols() {
+    if (!direct) target.FindFunctions("dlopen");
+  }
+
+  void loadLibrary(const string& antmanLibPath) {
+    if (!direct) {
+      runCmd("expr (void*)dlopen(\"" + antmanLibPath + "\", 0x2)");
+      return;
+    }
+
+    uint64_t flags = RTLD_NOW;
+    auto dlopenAddress = findRemoteDlopen(pid(), currentMaps(), flags);
+    if (dlopenAddress == 0) throw InjectionError("Could not find dlopen in target");
+
+    auto handle = call(dlopenAddress, {pushString(antmanLibPath), flags});
+    maps.clear();
+    if (handle == 0) {
+      auto dlerrorAddress = findRemoteSymbol(pid(), currentMaps(), libdlModules, "dlerror");
+      auto message = dlerrorAddress ? readString(call(dlerrorAddress, {})) : "unknown error";
+      throw InjectionError("dlopen failed in target: " + message);
+    }
+  }
+
+  void init() {
+    if (direct) {
+      call(antmanFunction("antmanInit"), {});
+    } else {
+      runCmd("expr (void)antmanInit()");
+    }
+  }
+
+  // Asks a loaded antman to stop its threads and drops every reference to it
+  // so another version can be loaded. Older injectors dlopen'd it on every
+  // run, so the reference count can be anything.
+  void unload(const string& antmanLibPath) {
+    if (!direct) {
+      if (target.FindFunctions("antmanShutdown").GetSize() == 0) {
+        throw InjectionError("The loaded antman is too old to be unloaded, restart the target to upgrade it");
+      }
+      // antmanShutdown returns a bool, only the low byte of the result is defined.
+      if (expr("(unsigned char)antmanShutdown()").GetValueAsUnsigned() == 0) {
+        throw InjectionError("The loaded antman is still running spawns, try again once they finished");
+      }
+
+      for (int i = 0; i < 64; i++) {
+        // RTLD_LAZY | RTLD_NOLOAD only takes a reference if it is still loaded.
+        auto handle = to_string(sizeExpr(("(size_t)dlopen(\"" + antmanLibPath + "\", 0x5)").c_str()));
+        if (handle == "0") return;
+        expr(("(int)dlclose((void*)" + handle + ")").c_str());
+        expr(("(int)dlclose((void*)" + handle + ")").c_str());
+      }
+      return;
+    }
+
+    // Before ABI 7 antman's functions had C++ linkage.
+    auto shutdownAddress = findRemoteSymbol(pid(), currentMaps(), {"libantman"}, "antmanShutdown");
+    if (shutdownAddress == 0) shutdownAddress = findRemoteSymbol(pid(), currentMaps(), {"libantman"}, "_Z14antmanShutdownv");
+    if (shutdownAddress == 0) {
+      throw InjectionError("The loaded antman is too old to be unloaded, restart the target to upgrade it");
+    }
+    // antmanShutdown returns a bool, only al is defined.
+    if ((call(shutdownAddress, {}) & 0xff) == 0) {
+      throw InjectionError("The loaded antman is still running spawns, try again once they finished");
+    }
+
+    uint64_t flags = RTLD_LAZY | RTLD_NOLOAD;
+    auto dlopenAddress = findRemoteDlopen(pid(), currentMaps(), flags);
+    auto dlcloseAddress = findRemoteSymbol(pid(), currentMaps(), libdlModules, "dlclose");
+    if (dlcloseAddress == 0) dlcloseAddress = findRemoteSymbol(pid(), currentMaps(), libcModules, "__libc_dlclose");
+    if (dlopenAddress == 0 || dlcloseAddress == 0) throw InjectionError("Could not find dlopen and dlclose in target");
+
+    for (int i = 0; i < 64; i++) {
+      auto handle = call(dlopenAddress, {pushString(antmanLibPath), flags});
+      if (handle == 0) break;
+      call(dlcloseAddress, {handle});
+      call(dlcloseAddress, {handle});
+    }
+    maps.clear();
+  }
+
+  // Returns the spawn's id for the status command.
+  unsigned spawn(const string& uri) {
+    if (direct) return static_cast<unsigned>(call(antmanFunction("antmanSpawn"), {pushString(uri)}));
+    return static_cast<unsigned>(sizeExpr(("(size_t)antmanSpawn(\"" + uri + "\")").c_str()));
+  }
+
+  lldb::addr_t alloc(size_t size) {
+    if (direct) return call(antmanFunction("antmanAlloc"), {size});
+    return sizeExpr(("(size_t)antmanAlloc(" + to_string(size) + ")").c_str());
+  }
+
+  unsigned spawnKernel(const string& uri, lldb::addr_t kernel, size_t size, int instances) {
+    if (direct) {
+      return static_cast<unsigned>(call(antmanFunction("antmanSpawnKernel"),
+        {pushString(uri), kernel, size, static_cast<uint64_t>(instances)}));
+    }
+    return static_cast<unsigned>(sizeExpr(("(size_t)antmanSpawnKernel(\"" + uri + "\", (void*)" + to_string(kernel) + ", " +
+      to_string(size) + ", " + to_string(instances) + ")").c_str()));
+  }
+
+  string info() {
+    auto result = direct ? call(antmanFunction("antmanInfo"), {}) : sizeExpr("(size_t)antmanInfo()");
+    bool ok;
+    return readResult(result, ok);
+  }
+
+  // Stops the target so expressions can be evaluated, the debugger is in
+  // synchronous mode so this returns once the process has stopped.
+  void pause() {
+    auto err = process.Stop();
+    if (err.Fail()) throw InjectionError(string("Failed to stop process: ") + err.GetCString());
+  }
+
+  // Lets the target run again without waiting for it to stop.
+  void resume() {
+    debugger.SetAsync(true);
+    auto err = process.Continue();
+    debugger.SetAsync(false);
+    if (err.Fail()) throw InjectionError(string("Failed to continue process: ") + err.GetCString());
+  }
+
+  void detach() {
+    if (returnBreakpoint.IsValid()) target.BreakpointDelete(returnBreakpoint.GetID());
+    process.Detach();
+  }
+
+  // Runs a control request through antmanRequest, for commands whose
+  // arguments can't be spelled as an expression.
+  string request(const std::vector<string>& args) {
+    auto buffer = control::encodeRequest(args);
+    auto remote = alloc(buffer.size());
+    if (remote == 0) throw InjectionError("Failed to allocate " + to_string(buffer.size()) + " bytes in target");
+    writeMemory(remote, buffer.data(), buffer.size());
+
+    auto result = direct
+      ? call(antmanFunction("antmanRequest"), {remote, buffer.size()})
+      : sizeExpr(("(size_t)antmanRequest((void*)" + to_string(remote) + ", " + to_string(buffer.size()) + ")").c_str());
+
+    bool ok;
+    auto output = readResult(result, ok);
+    if (!ok) throw InjectionError(output);
+    return output;
+  }
+
+  // Reads a result from antman's result region. The region is at least
+  // antmanResultMinSize bytes, so small results take a single read.
+  string readResult(lldb::addr_t address, bool& ok) {
+    if (address == 0) throw InjectionError("antman could not map its result region");
+
+    std::vector<char> buffer(antmanResultMinSize);
+    if (!readRemoteMemory(pid(), address, buffer.data(), buffer.size())) {
+      throw InjectionError("Failed to read result from target");
+    }
+
+    AntmanResultHeader header;
+    memcpy(&header, buffer.data(), sizeof(header));
+    ok = header.status == 0;
+
+    auto inlineSize = std::min<uint64_t>(header.length, buffer.size() - sizeof(header));
+    string output(buffer.data() + sizeof(header), inlineSize);
+    if (header.length > inlineSize) {
+      output.resize(header.length);
+      if (!readRemoteMemory(pid(), address + buffer.size(), &output[inlineSize], header.length - inlineSize)) {
+        throw InjectionError("Failed to read result from target");
+      }
+    }
+    return output;
+  }
+
+  void writeMemory(lldb::addr_t address, const void* data, size_t size) {
+    iovec local = {const_cast<void*>(data), size};
+    iovec remote = {reinterpret_cast<void*>(address), size};
+    auto pid = static_cast<pid_t>(process.GetProcessID());
+    if (process_vm_writev(pid, &local, 1, &remote, 1, 0) == static_cast<ssize_t>(size)) return;
+
     lldb::SBError err;
-    process.ReadCStringFromMemory(str, (void*)&o[0], len, err);
+    process.WriteMemory(address, data, size, err);
     assertSBErr(err);
-    expr(("free(" + strPtr + ")").c_str());
-    return o;
   }
 
-  void updateTarget() {
-    target = debugger.GetSelectedTarget();
-    process = target.GetProcess();
+  // x86_64 targets are called directly instead of through the expression
+  // evaluator, which compiles a C++ snippet with clang for every call. Other
+  // architectures keep using expressions, and so does --expressions.
+#if defined(__x86_64__)
+  static constexpr bool directSupported = true;
+#else
+  static constexpr bool directSupported = false;
+#endif
+  bool direct = directSupported;
+
+  // Calls a function on one thread of the stopped target and returns rax.
+  // The thread gets the arguments in registers and returns to the
+  // executable's entry point, which has a breakpoint on it and never runs
+  // again after startup. All of its registers are put back afterwards.
+  uint64_t call(uint64_t function, std::initializer_list<uint64_t> args) {
+    auto frame = callFrame();
+
+    if (returnAddress == 0) {
+      returnAddress = target.GetModuleAtIndex(0).GetObjectFileEntryPointAddress().GetLoadAddress(target);
+      if (returnAddress == 0 || returnAddress == LLDB_INVALID_ADDRESS) {
+        throw InjectionError("Could not find the target's entry point");
+      }
+      returnBreakpoint = target.BreakpointCreateByAddress(returnAddress);
+    }
+
+    auto saved = saveRegisters(frame);
+
+    auto sp = scratch != 0 ? scratch : remote_call::scratchBase(frame.FindRegister("rsp").GetValueAsUnsigned());
+    sp = remote_call::callStack(sp);
+    scratch = 0;
+    writeMemory(sp, &returnAddress, sizeof(returnAddress));
+
+    setRegister(frame, "rsp", sp);
+    setRegister(frame, "rip", function);
+    setRegister(frame, "rax", 0);
+    if (frame.FindRegister("orig_rax").IsValid()) setRegister(frame, "orig_rax", remote_call::noSyscallRestart);
+
+    static const char* argRegisters[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+    size_t i = 0;
+    for (auto arg : args) setRegister(frame, argRegisters[i++], arg);
+
+    // Other threads may stop the process on the way, e.g. for signals.
+    for (int stops = 0; stops < 100; stops++) {
+      auto err = process.Continue();
+      if (err.Fail()) throw InjectionError(string("Failed to continue process: ") + err.GetCString());
+      if (process.GetState() == lldb::eStateExited) throw InjectionError("Target exited during call");
+
+      auto thread = process.GetThreadByID(callThread);
+      if (!thread.IsValid()) throw InjectionError("The thread making a remote call exited");
+      frame = thread.GetFrameAtIndex(0);
+      if (frame.FindRegister("rip").GetValueAsUnsigned() == returnAddress) {
+        auto result = frame.FindRegister("rax").GetValueAsUnsigned();
+        restoreRegisters(frame, saved);
+        return result;
+      }
+
+      if (thread.GetStopReason() == lldb::eStopReasonSignal) {
+        auto sig = static_cast<int>(thread.GetStopReasonDataAtIndex(0));
+        if (sig == SIGSEGV || sig == SIGBUS || sig == SIGILL || sig == SIGFPE || sig == SIGABRT) {
+          throw InjectionError("Target crashed with signal " + to_string(sig) + " during remote call");
+        }
+      }
+    }
+
+    throw InjectionError("Remote call did not return");
+  }
+
+  // Copies a string below the calling thread's stack pointer for the next call.
+  uint64_t pushString(const string& str) {
+    if (scratch == 0) scratch = remote_call::scratchBase(callFrame().FindRegister("rsp").GetValueAsUnsigned());
+    scratch = remote_call::pushString(scratch, str.size());
+    writeMemory(scratch, str.c_str(), str.size() + 1);
+    return scratch;
+  }
+
+  string readString(uint64_t address) {
+    string str;
+    if (!readRemoteString(pid(), address, str)) throw InjectionError("Failed to read string from target");
+    return str;
+  }
+
+  uint64_t function(const std::vector<string>& modules, const string& symbol) {
+    auto address = findRemoteSymbol(pid(), currentMaps(), modules, symbol);
+    if (address == 0) throw InjectionError("Could not find " + symbol + " in target");
+    return address;
+  }
+
+  uint64_t antmanFunction(const string& symbol) {
+    return function({"libantman"}, symbol);
   }
 
   lldb::SBDebugger debugger;
   lldb::SBCommandInterpreter interpreter;
   lldb::SBTarget target;
   lldb::SBProcess process;
+
+private:
+  struct SavedRegister {
+    string name;
+    std::vector<uint8_t> bytes;
+  };
+
+  int pid() {
+    return static_cast<int>(process.GetProcessID());
+  }
+
+  const std::vector<MapEntry>& currentMaps() {
+    if (maps.empty()) maps = readMaps(pid());
+    return maps;
+  }
+
+  // Calls go through the same thread, the one selected on attach, until it
+  // exits. Then the thread selected now takes over, strings pushed on the old
+  // one's stack are gone with it.
+  lldb::SBFrame callFrame() {
+    auto thread = callThread != 0 ? process.GetThreadByID(callThread) : lldb::SBThread();
+    if (!thread.IsValid()) {
+      thread = process.GetSelectedThread();
+      if (!thread.IsValid()) thread = process.GetThreadAtIndex(0);
+      if (!thread.IsValid()) throw InjectionError("The target has no thread to make calls on");
+      callThread = thread.GetThreadID();
+      scratch = 0;
+    }
+    return thread.GetFrameAtIndex(0);
+  }
+
+  // Saves every register, including the vector ones the callee may clobber.
+  std::vector<SavedRegister> saveRegisters(lldb::SBFrame& frame) {
+    std::vector<SavedRegister> saved;
+    auto sets = frame.GetRegisters();
+    for (uint32_t i = 0; i < sets.GetSize(); i++) {
+      auto set = sets.GetValueAtIndex(i);
+      for (uint32_t j = 0; j < set.GetNumChildren(); j++) {
+        auto reg = set.GetChildAtIndex(j);
+        auto data = reg.GetData();
+        lldb::SBError err;
+        SavedRegister entry = {reg.GetName() ? reg.GetName() : "", std::vector<uint8_t>(data.GetByteSize())};
+        if (entry.name.empty() || entry.bytes.empty()) continue;
+        if (data.ReadRawData(err, 0, entry.bytes.data(), entry.bytes.size()) == entry.bytes.size()) saved.push_back(std::move(entry));
+      }
+    }
+    return saved;
+  }
+
+  void restoreRegisters(lldb::SBFrame& frame, const std::vector<SavedRegister>& saved) {
+    for (auto& entry : saved) {
+      lldb::SBError err;
+      lldb::SBData data;
+      data.SetData(err, entry.bytes.data(), entry.bytes.size(), lldb::eByteOrderLittle, 8);
+      frame.FindRegister(entry.name.c_str()).SetData(data, err);
+    }
+  }
+
+  void setRegister(lldb::SBFrame& frame, const char* name, uint64_t value) {
+    lldb::SBError err;
+    if (!frame.FindRegister(name).SetValueFromCString(to_string(value).c_str(), err)) {
+      throw InjectionError(string("Failed to set ") + name + ": " + (err.GetCString() ? err.GetCString() : "unknown error"));
+    }
+  }
+
+  std::vector<MapEntry> maps;
+  lldb::tid_t callThread = 0;
+  lldb::addr_t returnAddress = 0;
+  lldb::SBBreakpoint returnBreakpoint;
+  uint64_t scratch = 0;
+};
+
+// Daemon sockets live in a directory only we can enter: $XDG_RUNTIME_DIR,
+// /run for root, or a per-user directory in /tmp. With create unset a missing
+// directory returns "", there can't be a daemon then.
+string daemonSocketDir(bool create) {
+  string dir;
+  auto runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime != nullptr && runtime[0] == '/') {
+    dir = string(runtime) + "/dart-inject";
+  } else if (getuid() == 0) {
+    dir = "/run/dart-inject";
+  } else {
+    dir = "/tmp/dart-inject-" + to_string(getuid());
+  }
+
+  if (create && mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    throw InjectionError("Failed to create '" + dir + "': " + strerror(errno));
+  }
+
+  struct stat st;
+  if (lstat(dir.c_str(), &st) == -1) {
+    if (!create && errno == ENOENT) return "";
+    throw InjectionError("Failed to stat '" + dir + "': " + strerror(errno));
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+    throw InjectionError("Refusing to use '" + dir + "', it is not a private directory owned by us");
+  }
+  return dir;
+}
+
+string daemonSocketPath(int pid, bool create) {
+  auto dir = daemonSocketDir(create);
+  if (dir.empty()) return "";
+  return dir + "/" + to_string(pid) + ".sock";
+}
+
+bool isCommandName(const string& name) {
+  return name == "spawn" || name == "spawn-source" || name == "info" || name == "pool" || name == "status";
+}
+
+// Splits the arguments of "batch" into commands, each starting at a command
+// name. A single argument that isn't a command name is read as a command file
+// with one command per line, blank lines and '#' comments are skipped.
+std::vector<std::vector<string>> splitBatch(const std::vector<string>& args) {
+  std::vector<std::vector<string>> commands;
+
+  if (args.size() == 2 && !isCommandName(args[1])) {
+    std::ifstream file(args[1]);
+    if (!file) throw InjectionError("Command file not found: '" + args[1] + "'");
+
+    string line;
+    while (std::getline(file, line)) {
+      std::istringstream words(line);
+      std::vector<string> command;
+      string word;
+      while (words >> word && word[0] != '#') command.push_back(word);
+      if (!command.empty()) commands.push_back(std::move(command));
+    }
+    return commands;
+  }
+
+  for (size_t i = 1; i < args.size(); i++) {
+    if (isCommandName(args[i]) || commands.empty()) commands.emplace_back();
+    commands.back().push_back(args[i]);
+  }
+  return commands;
+}
+
+// Validates a command and makes its paths absolute so it can be executed
+// by a daemon with a different working directory. Spawns are turned into
+// "<command> <uri> <instances> ..." requests.
+bool prepareCommand(std::vector<string>& args, const string& cwd, int instances) {
+  // SPAWN //
+  if (args[0] == "spawn") {
+    if (args.size() != 2) {
+      cerr << "Error: Wrong number of arguments." << endl;
+      return false;
+    }
+
+    if (args[1][0] != '/') {
+      args[1] = cwd + "/" + args[1];
+    }
+
+    if (access(args[1].c_str(), F_OK) == -1) {
+      throw InjectionError("Script file not found: '" + args[1] + "'");
+    }
+
+    args.push_back(to_string(instances));
+
+  // SPAWN-SOURCE //
+  } else if (args[0] == "spawn-source") {
+    if (args.size() < 2) {
+      cerr << "Error: Wrong number of arguments." << endl;
+      return false;
+    }
+
+    // The first file is the script, the rest are libraries it imports. All of
+    // them are sent as source text, nothing has to exist in the target.
+    std::vector<string> request = {"spawn-source", "", to_string(instances)};
+    for (size_t i = 1; i < args.size(); i++) {
+      auto path = args[i][0] == '/' ? args[i] : cwd + "/" + args[i];
+      std::ifstream file(path, std::ios::binary);
+      if (!file) throw InjectionError("Script file not found: '" + path + "'");
+
+      std::ostringstream source;
+      source << file.rdbuf();
+      request.push_back("file://" + path);
+      request.push_back(source.str());
+    }
+    request[1] = request[3];
+    args = std::move(request);
+
+  // INFO //
+  } else if (args[0] == "info") {
+    if (args.size() != 1) {
+      cerr << "Error: Wrong number of arguments." << endl;
+      return false;
+    }
+
+  // POOL //
+  } else if (args[0] == "pool") {
+    uint64_t size;
+    if (args.size() != 2 || !control::parseNumber(args[1], 0, antmanPoolSizeLimit, size)) {
+      cerr << "Error: Expected a pool size of at most " << antmanPoolSizeLimit << "." << endl;
+      return false;
+    }
+
+  // STATUS //
+  } else if (args[0] == "status") {
+    uint64_t id;
+    if (args.size() != 2 || !control::parseNumber(args[1], 0, UINT32_MAX, id)) {
+      cerr << "Error: Expected a spawn id." << endl;
+      return false;
+    }
+
+  // WATCH //
+  } else if (args[0] == "watch") {
+    if (args.size() != 3) {
+      cerr << "Error: watch takes --interval and --duration." << endl;
+      return false;
+    }
+
+  // BATCH //
+  } else if (args[0] == "batch") {
+    auto commands = splitBatch(args);
+    if (commands.empty()) {
+      cerr << "Error: Empty batch." << endl;
+      return false;
+    }
+
+    for (auto& command : commands) {
+      if (command[0] == "batch" || command[0] == "watch" || !prepareCommand(command, cwd, instances)) return false;
+    }
+    args = control::encodeBatch(commands);
+  } else {
+    cerr << "Error: Unknown command '" << args[0] << "'." << endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool isKernelPath(const string& path) {
+  return path.size() > 5 && path.compare(path.size() - 5, 5, ".dill") == 0;
+}
+
+// Compiles a script with the local Dart SDK into a memfd so the target never
+// has to run the frontend, returns the descriptor.
+int compileKernel(const string& dart, const string& scriptPath) {
+  int fd = memfd_create("dart-inject-kernel", MFD_CLOEXEC);
+  if (fd == -1) throw InjectionError("Failed to create memfd: " + string(strerror(errno)));
+
+  // The child can't inherit a CLOEXEC descriptor, it writes through our /proc entry instead.
+  auto output = "/proc/" + to_string(getpid()) + "/fd/" + to_string(fd);
+  if (verbose) cout << "Compiling '" << scriptPath << "' with " << dart << endl;
+
+  // `dart compile kernel` is newer than the SDKs antman supports, the VM's own
+  // kernel snapshot writes the same file and exits without running main.
+  auto snapshot = "--snapshot=" + output;
+  pid_t child = fork();
+  if (child == 0) {
+    execlp(dart.c_str(), dart.c_str(), "--snapshot-kind=kernel", snapshot.c_str(), scriptPath.c_str(), nullptr);
+    _exit(127);
+  }
+
+  int status = 0;
+  if (child == -1 || waitpid(child, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    close(fd);
+    throw InjectionError("Failed to compile '" + scriptPath + "' with '" + dart + "'");
+  }
+
+  return fd;
+}
+
+// The version number at the start of the first word that starts with a digit,
+// e.g. 2.3.0 for `Dart VM version: 2.3.0 (Tue Apr 23 ...) on "linux_x64"`.
+string versionNumber(const string& version) {
+  std::istringstream words(version);
+  string word;
+  while (words >> word) {
+    if (isdigit(static_cast<unsigned char>(word[0]))) return word;
+  }
+  return "";
+}
+
+// The version the local SDK prints for `dart --version`, on stderr in the
+// SDKs antman supports and on stdout in newer ones.
+string localDartVersion(const string& dart) {
+  int pipes[2];
+  if (pipe2(pipes, O_CLOEXEC) == -1) throw InjectionError("Failed to create pipe: " + string(strerror(errno)));
+
+  pid_t child = fork();
+  if (child == 0) {
+    dup2(pipes[1], STDOUT_FILENO);
+    dup2(pipes[1], STDERR_FILENO);
+    execlp(dart.c_str(), dart.c_str(), "--version", nullptr);
+    _exit(127);
+  }
+  close(pipes[1]);
+
+  string output;
+  char buffer[256];
+  ssize_t n;
+  while ((n = read(pipes[0], buffer, sizeof(buffer))) > 0 || (n == -1 && errno == EINTR)) {
+    if (n > 0) output.append(buffer, static_cast<size_t>(n));
+  }
+  close(pipes[0]);
+
+  int status = 0;
+  if (child == -1 || waitpid(child, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    throw InjectionError("Failed to run '" + dart + " --version'");
+  }
+  return versionNumber(output);
+}
+
+// Kernel files only load in the VM version that wrote them. Fails before
+// compiling if the local SDK doesn't match a target, targets whose version
+// discovery couldn't read are let through.
+void checkLocalVersion(const string& dart, const std::vector<DartProcess>& processes, const std::vector<int>& pids) {
+  auto local = localDartVersion(dart);
+  for (auto pid : pids) {
+    auto process = std::find_if(processes.begin(), processes.end(), [&](const DartProcess& p) { return p.pid == pid; });
+    if (process == processes.end()) continue;
+
+    auto target = versionNumber(process->version);
+    if (!target.empty() && target != local) {
+      throw InjectionError("--compile-local needs the target's Dart version, " + to_string(pid) + " runs " + target +
+                           " but '" + dart + "' is " + (local.empty() ? "unknown" : local));
+    }
+  }
+}
+
+// Runs a prepared command in a stopped target, returning its output.
+// Arguments come from prepareCommand or, in the daemon, from a client, so
+// they are checked like antman checks control requests.
+string runCommand(antmanInjector& injector, const std::vector<string>& args) {
+  if (args.empty()) throw InjectionError("Empty command");
+
+  if (args[0] == "spawn" && args.size() == 3 && args[2] == "1") {
+    return "Spawn " + to_string(injector.spawn(args[1]));
+  } else if (args[0] == "spawn-kernel") {
+    uint64_t fd, instances;
+    if (args.size() != 4 || !control::parseNumber(args[3], 0, INT32_MAX, fd) ||
+        !control::parseNumber(args[2], 1, antmanInstancesLimit, instances)) {
+      throw InjectionError("Invalid spawn-kernel request");
+    }
+
+    struct stat st = {};
+    if (fstat(static_cast<int>(fd), &st) == -1 || st.st_size == 0) throw InjectionError("Kernel for '" + args[1] + "' is empty");
+
+    auto size = static_cast<size_t>(st.st_size);
+    void* kernel = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, static_cast<int>(fd), 0);
+    if (kernel == MAP_FAILED) throw InjectionError("Failed to map kernel: " + string(strerror(errno)));
+
+    auto remote = injector.alloc(size);
+    if (remote == 0) {
+      munmap(kernel, size);
+      throw InjectionError("Failed to allocate " + to_string(size) + " bytes in target");
+    }
+
+    injector.writeMemory(remote, kernel, size);
+    munmap(kernel, size);
+
+    return "Spawn " + to_string(injector.spawnKernel(args[1], remote, size, static_cast<int>(instances)));
+  } else if (args[0] == "info" && args.size() == 1) {
+    return injector.info();
+  }
+
+  return injector.request(args);
+}
+
+// Sends a request over a connected control socket and closes it.
+string sendCommand(int fd, const std::vector<string>& args, const string& name) {
+  bool ok;
+  string output;
+  bool sent = control::sendRequest(fd, args) && control::recvResponse(fd, ok, output);
+  close(fd);
+
+  if (!sent) throw InjectionError("Lost connection to '" + name + "'");
+  if (!ok) throw InjectionError(output);
+  return output;
+}
+
+// Returns the pid of a process as seen from inside its own pid namespace,
+// which is what antman uses to name its socket.
+int namespacePid(int pid) {
+  std::ifstream status("/proc/" + to_string(pid) + "/status");
+  string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "NSpid:") == 0) {
+      auto pos = line.find_last_of(" \t");
+      return std::stoi(line.substr(pos + 1));
+    }
+  }
+  return pid;
+}
+
+// Sends a command to antman's control channel in the target if it is already
+// loaded, this does not stop the process. Returns false if it isn't.
+bool tryControl(int pid, const std::vector<string>& args, string& output) {
+  if (pid == -1) return false;
+
+  auto name = control::antmanSocketName(namespacePid(pid));
+  int fd = control::connectSocket(name, true);
+  if (fd == -1) return false;
+
+  // Abstract sockets are scoped by network namespace, not pid namespace, so
+  // with a shared host network another container's antman can hold the name.
+  ucred cred = {};
+  if (!control::peerCredentials(fd, cred) || cred.pid != pid) {
+    if (verbose) cout << "Control channel '@" << name << "' belongs to another process" << endl;
+    close(fd);
+    return false;
+  }
+
+  if (verbose) cout << "Using control channel '@" << name << "'" << endl;
+  output = sendCommand(fd, args, "@" + name);
+  return true;
+}
+
+// Sends a command to a running daemon, returns false if there is none.
+bool tryDaemon(int pid, const std::vector<string>& args, string& output) {
+  if (pid == -1) return false;
+
+  auto path = daemonSocketPath(pid, false);
+  if (path.empty()) return false;
+  int fd = control::connectSocket(path, false);
+  if (fd == -1) return false;
+  if (!control::isTrustedPeer(fd)) {
+    close(fd);
+    throw InjectionError("Daemon at '" + path + "' is not running as our user or root");
+  }
+
+  if (verbose) cout << "Using daemon at '" << path << "'" << endl;
+  output = sendCommand(fd, args, path);
+  return true;
+}
+
+enum class AntmanState { missing, compatible, incompatible };
+
+// Looks for an antman that is already mapped in the target and checks its
+// ABI stamp, without stopping the process. An antman without a readable
+// stamp, or whose file was replaced, counts as incompatible.
+AntmanState antmanState(int pid, string& loadedPath) {
+  auto maps = readMaps(pid);
+  findModule(maps, {"libantman"}, loadedPath);
+  if (loadedPath.empty()) return AntmanState::missing;
+
+  static const string deleted = " (deleted)";
+  if (loadedPath.size() > deleted.size() &&
+      loadedPath.compare(loadedPath.size() - deleted.size(), deleted.size(), deleted) == 0) {
+    loadedPath.resize(loadedPath.size() - deleted.size());
+    return AntmanState::incompatible;
+  }
+
+  uint32_t abi = 0;
+  try {
+    auto address = findRemoteSymbol(pid, maps, {"libantman"}, "antmanAbiVersion");
+    if (address == 0 || !readRemoteMemory(pid, address, &abi, sizeof(abi))) abi = 0;
+  } catch (const InjectionError&) {
+    abi = 0;
+  }
+
+  if (verbose) cout << "Found antman with ABI " << abi << " at '" << loadedPath << "'" << endl;
+  return abi == antmanAbi ? AntmanState::compatible : AntmanState::incompatible;
+}
+
+struct InjectOptions {
+  string antmanLibPath;
+  bool usePtrace = false;
+  // Only load antman while the target is stopped, the command itself goes
+  // over the control channel after detaching.
+  bool detachEarly = false;
+  // Aborts the injection once the target was stopped for longer, 0 for no limit.
+  int64_t stopBudgetMicros = 0;
+  // Never stop the target, only talk to an antman that is already running.
+  bool noAttach = false;
+  // Call into the target through lldb's expression evaluator even where
+  // direct calls are supported.
+  bool useExpressions = false;
+};
+
+// Checked between phases, a call that is already running can't be cut short.
+void checkStopBudget(const PhaseTimer& timer, const InjectOptions& options) {
+  if (options.stopBudgetMicros <= 0) return;
+
+  auto stopped = timer.stoppedMicros();
+  if (stopped > options.stopBudgetMicros) {
+    throw InjectionError("Stop budget of " + to_string(options.stopBudgetMicros / 1000) + " ms exceeded (stopped for " +
+                         to_string(stopped / 1000) + " ms), aborting");
+  }
+}
+
+// Attaches with liblldb and makes sure a compatible antman is loaded and
+// initialized, leaving the target stopped. A compatible antman is used as
+// is, another version is unloaded first.
+void loadWithLldb(antmanInjector& injector, int pid, const InjectOptions& options,
+                  AntmanState state, const string& loadedPath, PhaseTimer::Scope& phase) {
+  injector.direct = antmanInjector::directSupported && !options.useExpressions;
+  phase.next("process attach", true);
+  injector.attach(pid);
+
+  if (state == AntmanState::incompatible) {
+    phase.next("antman unload", true);
+    checkStopBudget(*phase.timer, options);
+    injector.unload(loadedPath);
+
+    string stillLoaded;
+    if (antmanState(pid, stillLoaded) != AntmanState::missing) {
+      throw InjectionError("The loaded antman could not be unloaded, restart the target to upgrade it");
+    }
+  }
+
+  if (state != AntmanState::compatible) {
+    phase.next("symbol load", true);
+    checkStopBudget(*phase.timer, options);
+    injector.loadSymbols();
+
+    phase.next("dlopen", true);
+    checkStopBudget(*phase.timer, options);
+    injector.loadLibrary(options.antmanLibPath);
+  }
+
+  // Cheap when it already ran, and it may not have if an earlier injection
+  // was aborted right after dlopen.
+  phase.next("antmanInit", true);
+  checkStopBudget(*phase.timer, options);
+  injector.init();
+}
+
+static std::once_flag lldbInitialized;
+
+// Runs a prepared command in one target. Goes through antman's control
+// channel or a daemon when possible, otherwise loads antman with the ptrace
+// loader or liblldb first.
+string injectCommand(int pid, const std::vector<string>& args, const InjectOptions& options, PhaseTimer& timer) {
+  string output;
+  string loadedPath;
+  AntmanState state;
+  {
+    auto phase = timer.phase("antman check");
+    state = antmanState(pid, loadedPath);
+  }
+
+  auto start = nowMicros();
+  if (state == AntmanState::compatible && tryControl(pid, args, output)) {
+    timer.add("control command", nowMicros() - start, 0);
+    return output;
+  } else if (!options.noAttach && !options.detachEarly && tryDaemon(pid, args, output)) {
+    // The daemon stops the target for the command, count all of it. That is
+    // what --detach-early avoids, so the daemon is skipped with it.
+    auto wall = nowMicros() - start;
+    timer.add("daemon command", wall, wall);
+    return output;
+  }
+
+  if (options.noAttach) {
+    throw InjectionError(state == AntmanState::missing
+      ? "antman is not loaded in the target (start it with LD_PRELOAD=libantman.so or drop --no-attach)"
+      : "antman's control channel is not reachable and --no-attach forbids attaching");
+  }
+
+  if (options.usePtrace) {
+    // A loaded antman whose channel is unreachable can't be helped by loading it again.
+    if (state == AntmanState::compatible) {
+      throw InjectionError("antman is loaded but its control channel is not reachable");
+    } else if (state == AntmanState::incompatible) {
+      throw InjectionError("Another version of antman is loaded, reloading it needs the liblldb path (drop --ptrace)");
+    }
+
+    ptraceLoad(pid, options.antmanLibPath, timer);
+    checkStopBudget(timer, options);
+
+    auto phase = timer.phase("control command");
+    if (!tryControl(pid, args, output)) {
+      throw InjectionError("antman was loaded but its control channel is not reachable");
+    }
+    return output;
+  }
+
+  auto phase = timer.phase("debugger create");
+  std::call_once(lldbInitialized, lldb::SBDebugger::Initialize);
+  antmanInjector injector;
+
+  try {
+    loadWithLldb(injector, pid, options, state, loadedPath, phase);
+
+    if (!options.detachEarly) {
+      phase.next("command", true);
+      checkStopBudget(timer, options);
+      output = runCommand(injector, args);
+    }
+  } catch (const InjectionError&) {
+    injector.detach();
+    throw;
+  }
+
+  phase.next("detach", true);
+  injector.detach();
+
+  if (options.detachEarly) {
+    phase.next("control command", false);
+    if (!tryControl(pid, args, output)) {
+      throw InjectionError("antman was loaded but its control channel is not reachable, run without --detach-early");
+    }
+  }
+  return output;
+}
+
+// Finds the targets of --all (every process embedding the Dart VM) or
+// --match (those whose command line matches the regex).
+std::vector<int> findTargets(const std::vector<DartProcess>& processes, bool all, const string& pattern) {
+  std::vector<int> pids;
+  try {
+    std::regex match(all ? "" : pattern, std::regex::extended | std::regex::nosubs);
+    for (auto& process : processes) {
+      if (all || std::regex_search(processCommandLine(process.pid), match)) pids.push_back(process.pid);
+    }
+  } catch (const std::regex_error& e) {
+    throw InjectionError("Invalid --match regex '" + pattern + "': " + e.what());
+  }
+  return pids;
+}
+
+// Picks the target when no pid was given, which is only unambiguous if a
+// single process runs the Dart VM.
+int defaultTarget(const std::vector<DartProcess>& processes) {
+  if (processes.empty()) throw InjectionError("No Dart process found");
+  if (processes.size() == 1) return processes[0].pid;
+
+  string pids;
+  for (auto& process : processes) pids += (pids.empty() ? "" : ", ") + to_string(process.pid);
+  throw InjectionError("Several Dart processes found (" + pids + "), pass -p, --all or --match");
+}
+
+string listTable(const std::vector<DartProcess>& processes) {
+  std::ostringstream out;
+  out << std::left << std::setw(8) << "PID" << std::setw(17) << "NAME" << std::setw(8) << "ANTMAN"
+      << std::setw(42) << "BUILD-ID" << "MODULE / VERSION";
+  for (auto& process : processes) {
+    out << '\n' << std::setw(8) << process.pid << std::setw(17) << process.name
+        << std::setw(8) << (process.antmanLoaded ? "yes" : "no")
+        << std::setw(42) << (process.buildId.empty() ? "-" : process.buildId) << process.module;
+    if (!process.version.empty()) out << '\n' << string(75, ' ') << process.version;
+  }
+  return out.str();
+}
+
+// Spawns run asynchronously in antman. Waits for the ones a command started,
+// going by the "Spawn <id>" lines of its output, and adds their phases.
+void appendSpawnTimings(int pid, const string& output, PhaseTimer& timer) {
+  std::vector<string> ids;
+  std::istringstream lines(output);
+  for (string line; std::getline(lines, line);) {
+    if (line.size() > 6 && line.compare(0, 6, "Spawn ") == 0 && line.find_first_not_of("0123456789", 6) == string::npos) {
+      ids.push_back(line.substr(6));
+    }
+  }
+
+  auto deadline = nowMicros() + 60 * 1000000;
+  for (auto& id : ids) {
+    string response;
+    while (tryControl(pid, {"timings", id}, response) && response.compare(0, 1, "1") != 0 && nowMicros() < deadline) {
+      usleep(10000);
+    }
+
+    auto newline = response.find('\n');
+    if (newline == string::npos) continue;
+    auto prefix = ids.size() == 1 ? string("antman ") : "antman " + id + " ";
+    timer.append(PhaseTimer::parse(response.substr(newline + 1)), prefix);
+  }
+}
+
+struct TargetResult {
+  int pid;
+  bool ok;
+  string output;
+  PhaseTimer timer;
+};
+
+// Injects into every target at once from a few worker threads, each with its
+// own debugger or ptrace loader, so the total time is that of the slowest
+// targets rather than the sum.
+std::vector<TargetResult> injectAll(const std::vector<int>& pids, const std::vector<string>& args,
+                                    const InjectOptions& options, bool timings) {
+  std::vector<TargetResult> results(pids.size());
+  std::atomic<size_t> nextTarget(0);
+
+  auto worker = [&] {
+    for (size_t i; (i = nextTarget++) < pids.size();) {
+      auto& result = results[i];
+      result.pid = pids[i];
+      try {
+        result.output = injectCommand(result.pid, args, options, result.timer);
+        result.ok = true;
+
+        if (timings) appendSpawnTimings(result.pid, result.output, result.timer);
+      } catch (const InjectionError& e) {
+        result.ok = false;
+        result.output = e.what;
+      }
+    }
+  };
+
+  auto threadCount = std::min<size_t>(pids.size(), 16);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < threadCount; i++) threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads) thread.join();
+
+  return results;
+}
+
+string formatLogRecord(const LogRecord& record) {
+  auto seconds = static_cast<time_t>(record.timeMicros / 1000000);
+  tm local = {};
+  localtime_r(&seconds, &local);
+  char time[32];
+  strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", &local);
+
+  std::ostringstream out;
+  out << time << '.' << std::setw(6) << std::setfill('0') << record.timeMicros % 1000000 << std::setfill(' ')
+      << ' ' << std::left << std::setw(5) << severityName(record.severity) << std::right;
+  if (record.isolate != 0) out << " [isolate " << record.isolate << "]";
+  out << ' ' << string(record.text, record.length);
+  return out.str();
+}
+
+// Prints the records in antman's log ring, with follow keeps printing new
+// ones until interrupted. The ring is mapped through the target's memfd, so
+// the target is never stopped.
+int tailLog(int pid, bool follow) {
+  int fd = openRemoteMemfd(pid, logRingName);
+  if (fd == -1) throw InjectionError("antman's log isn't open in process " + to_string(pid) + ", is antman loaded?");
+
+  struct stat st = {};
+  fstat(fd, &st);
+  auto size = static_cast<size_t>(st.st_size);
+  void* mapping = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mapping == MAP_FAILED) throw InjectionError("Failed to map antman's log: " + string(strerror(errno)));
+
+  LogRing ring;
+  if (!ring.attach(mapping, size, false)) {
+    munmap(mapping, size);
+    throw InjectionError("antman's log has an unknown format, it may be from another version");
+  }
+
+  auto slots = ring.header->slotCount;
+  auto head = ring.header->head.load(std::memory_order_acquire);
+  uint64_t index = head > slots ? head - slots : 0;
+  uint64_t lost = 0;
+  int pendingPolls = 0;
+
+  while (true) {
+    head = ring.header->head.load(std::memory_order_acquire);
+    while (index < head) {
+      LogRecord record;
+      auto result = ring.read(index, record);
+
+      if (result == LogRing::ReadResult::pending) {
+        // Still being written, unless it stays that way because its writer dropped it.
+        if (follow && ++pendingPolls < 10) break;
+        index++;
+        pendingPolls = 0;
+        continue;
+      }
+      pendingPolls = 0;
+
+      if (result == LogRing::ReadResult::overwritten) {
+        // We fell a lap behind, skip to the oldest record still in the ring.
+        auto oldest = ring.header->head.load(std::memory_order_acquire) - slots;
+        auto next = std::max(index + 1, oldest);
+        lost += next - index;
+        index = next;
+        continue;
+      }
+
+      if (lost > 0) {
+        cout << "-- " << lost << " records lost --" << endl;
+        lost = 0;
+      }
+      cout << formatLogRecord(record) << '\n';
+      index++;
+    }
+
+    cout.flush();
+    if (!follow) break;
+    usleep(100000);
+  }
+
+  auto dropped = ring.header->dropped.load(std::memory_order_relaxed);
+  if (dropped > 0) cerr << "antman dropped " << dropped << " records while the ring was full" << endl;
+  munmap(mapping, size);
+  return 0;
+}
+
+// Prints what a spawn prints until its main returned, with one control
+// request per poll for everything printed since the last one. Throws with
+// the spawn's status if it failed.
+void followSpawn(int pid, const string& id) {
+  uint64_t offset = 0;
+  while (true) {
+    string response;
+    if (!tryControl(pid, {"output", id, to_string(offset)}, response)) {
+      throw InjectionError("antman's control channel is needed to follow spawn " + id);
+    }
+
+    auto newline = response.find('\n');
+    std::istringstream header(response.substr(0, newline));
+    uint64_t skipped = 0;
+    string state;
+    int finished = 0;
+    header >> offset >> skipped >> state >> finished;
+
+    if (skipped > 0) cerr << "-- " << skipped << " bytes of output lost --" << endl;
+    if (newline != string::npos) cout << response.substr(newline + 1) << std::flush;
+
+    if (finished) {
+      // status fails for failed spawns, which throws with its report.
+      if (state == "failed") tryControl(pid, {"status", id}, response);
+      return;
+    }
+    usleep(100000);
+  }
+}
+
+// Parses durations like 500us, 10ms, 60s or 2m into microseconds.
+int64_t parseDuration(const string& text) {
+  size_t end = 0;
+  double value = 0;
+  try {
+    value = std::stod(text, &end);
+  } catch (const std::exception&) {
+    end = 0;
+  }
+
+  auto unit = text.substr(end);
+  double scale = unit == "us" ? 1 : unit == "ms" ? 1e3 : unit == "s" ? 1e6 : unit == "m" ? 60e6 : 0;
+  if (end == 0 || scale == 0 || !(value > 0)) throw InjectionError("Invalid duration '" + text + "', expected e.g. 10ms or 60s");
+  if (value * scale > antmanWatchDurationLimit) throw InjectionError("Invalid duration '" + text + "', at most a day");
+  return static_cast<int64_t>(value * scale);
+}
+
+static volatile sig_atomic_t watchInterrupted = 0;
+
+// Reads rows until the watch is over or we are interrupted. CSV rows are
+// written as they arrive, columnar ones are collected.
+void readWatchRows(int pid, bool columnar, std::ostream& out, std::vector<WatchRow>& rows,
+                   std::map<int64_t, string>& names) {
+  uint64_t offset = 0;
+  while (true) {
+    string response;
+    if (!tryControl(pid, {"watch-read", to_string(offset)}, response)) {
+      throw InjectionError("antman's control channel is needed to read the watch");
+    }
+
+    auto lineEnd = response.find('\n');
+    std::istringstream header(response.substr(0, lineEnd));
+    uint64_t lost = 0;
+    int finished = 0;
+    size_t nameCount = 0;
+    header >> offset >> lost >> finished >> nameCount;
+
+    auto pos = lineEnd == string::npos ? response.size() : lineEnd + 1;
+    for (size_t i = 0; i < nameCount && pos < response.size(); i++) {
+      lineEnd = response.find('\n', pos);
+      auto space = response.find(' ', pos);
+      if (lineEnd == string::npos || space > lineEnd) break;
+      names[strtoll(response.c_str() + pos, nullptr, 10)] = response.substr(space + 1, lineEnd - space - 1);
+      pos = lineEnd + 1;
+    }
+
+    if (lost > 0) cerr << "-- " << lost << " samples lost --" << endl;
+
+    for (; pos + sizeof(WatchRow) <= response.size(); pos += sizeof(WatchRow)) {
+      WatchRow row;
+      memcpy(&row, response.data() + pos, sizeof(row));
+      if (columnar) {
+        rows.push_back(row);
+        continue;
+      }
+
+      auto state = row.state < sizeof(watchStates) / sizeof(watchStates[0]) ? watchStates[row.state] : "?";
+      auto& name = names[row.port];
+      out << row.timeMicros << ',' << row.port << ',';
+      if (name.find_first_of(",\"") == string::npos) {
+        out << name;
+      } else {
+        out << '"';
+        for (auto c : name) out << (c == '"' ? "\"\"" : string(1, c));
+        out << '"';
+      }
+      out << ',' << state << ',' << row.heapNewBytes << ',' << row.heapOldBytes << ',' << int(row.messagesPending) << '\n';
+    }
+    out.flush();
+
+    if (finished || watchInterrupted) return;
+    usleep(200000);
+  }
+}
+
+// Receives the samples of a watch from antman until it is over. CSV rows
+// are written as they arrive, the columnar file is written at the end:
+// "ANTWATCH", a uint32 version, a uint32 name count and a uint64 row count,
+// then each column as one array (int64 time_us, port, heap_new_bytes,
+// heap_old_bytes, uint8 state, messages_pending), then the names as int64
+// port, uint32 length and the name's bytes. Everything is little-endian.
+// On SIGINT or SIGTERM, or if reading fails, the watch is stopped in the
+// target and what arrived so far is written. antman stops a watch nobody
+// reads by itself, for readers that are killed.
+void receiveWatch(int pid, bool columnar, std::ostream& out) {
+  std::vector<WatchRow> rows;
+  std::map<int64_t, string> names;
+  if (!columnar) out << "time_us,port,name,state,heap_new_bytes,heap_old_bytes,messages_pending\n";
+
+  // No SA_RESTART so the sleep between reads ends early.
+  struct sigaction action = {}, previousInt, previousTerm;
+  action.sa_handler = [](int) { watchInterrupted = 1; };
+  sigaction(SIGINT, &action, &previousInt);
+  sigaction(SIGTERM, &action, &previousTerm);
+
+  auto stop = [&] {
+    sigaction(SIGINT, &previousInt, nullptr);
+    sigaction(SIGTERM, &previousTerm, nullptr);
+    try {
+      string response;
+      tryControl(pid, {"watch-stop"}, response);
+    } catch (const InjectionError& e) {
+      if (verbose) cout << "Failed to stop the watch: " << e.what << endl;
+    }
+  };
+
+  try {
+    readWatchRows(pid, columnar, out, rows, names);
+  } catch (...) {
+    stop();
+    throw;
+  }
+  stop();
+
+  if (!columnar) return;
+
+  auto put = [&out](const void* data, size_t size) { out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size)); };
+  uint32_t version = 1;
+  auto nameCount = static_cast<uint32_t>(names.size());
+  uint64_t rowCount = rows.size();
+  put("ANTWATCH", 8);
+  put(&version, sizeof(version));
+  put(&nameCount, sizeof(nameCount));
+  put(&rowCount, sizeof(rowCount));
+  for (auto& row : rows) put(&row.timeMicros, sizeof(row.timeMicros));
+  for (auto& row : rows) put(&row.port, sizeof(row.port));
+  for (auto& row : rows) put(&row.heapNewBytes, sizeof(row.heapNewBytes));
+  for (auto& row : rows) put(&row.heapOldBytes, sizeof(row.heapOldBytes));
+  for (auto& row : rows) put(&row.state, 1);
+  for (auto& row : rows) put(&row.messagesPending, 1);
+  for (auto& entry : names) {
+    auto length = static_cast<uint32_t>(entry.second.size());
+    put(&entry.first, sizeof(entry.first));
+    put(&length, sizeof(length));
+    put(entry.second.data(), length);
+  }
+  out.flush();
+}
+
+static volatile sig_atomic_t daemonStopping = 0;
+
+// Resumes a target paused for a daemon request however the request ends.
+// resume() reports a failure to the caller, the destructor only logs it.
+struct DaemonPause {
+  explicit DaemonPause(antmanInjector& injector) : injector(injector) {
+    injector.pause();
+  }
+
+  ~DaemonPause() {
+    if (resumed) return;
+    try {
+      injector.resume();
+    } catch (const InjectionError& e) {
+      cerr << "Error: " << e.what << endl;
+    }
+  }
+
+  void resume() {
+    resumed = true;
+    injector.resume();
+  }
+
+  antmanInjector& injector;
+  bool resumed = false;
 };
 
+// Keeps the injector attached with antman loaded and serves commands from
+// a unix socket, the target only stops while a command is running.
+int runDaemon(antmanInjector& injector) {
+  auto pid = static_cast<int>(injector.process.GetProcessID());
+  auto path = daemonSocketPath(pid, true);
+
+  int fd = control::listenSocket(path, false);
+  if (fd == -1) throw InjectionError("Failed to listen on '" + path + "': " + strerror(errno));
+
+  // No SA_RESTART so accept() returns when we are asked to stop.
+  struct sigaction action = {};
+  action.sa_handler = [](int) { daemonStopping = 1; };
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  injector.resume();
+  cout << "Daemon attached to " << pid << ", listening on '" << path << "'" << endl;
+
+  while (!daemonStopping) {
+    int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client == -1) {
+      if (errno == EINTR) continue;
+      cerr << "Error: accept failed: " << strerror(errno) << endl;
+      break;
+    }
+
+    std::vector<string> args;
+    if (!control::isTrustedPeer(client)) {
+      if (verbose) cout << "Daemon rejected a client running as another user" << endl;
+    } else if (control::setPeerTimeouts(client) && control::recvRequest(client, args) && !args.empty()) {
+      if (verbose) cout << "Daemon request: " << args[0] << endl;
+      bool ok = true;
+      string output;
+      // recvRequest put the received descriptor's number there.
+      int received = control::carriesFd(args) ? std::stoi(args.back()) : -1;
+      try {
+        DaemonPause pause(injector);
+        try {
+          output = runCommand(injector, args);
+        } catch (const InjectionError& e) {
+          ok = false;
+          output = e.what;
+        } catch (const std::exception& e) {
+          ok = false;
+          output = string("Command failed: ") + e.what();
+        }
+        pause.resume();
+      } catch (const InjectionError& e) {
+        ok = false;
+        output = e.what;
+      }
+      if (received != -1) close(received);
+      control::sendResponse(client, ok, output);
+    }
+    close(client);
+
+    if (injector.process.GetState() == lldb::eStateExited) {
+      cerr << "Error: Target process exited." << endl;
+      break;
+    }
+  }
+
+  close(fd);
+  unlink(path.c_str());
+  injector.detach();
+  cout << "Daemon detached from " << pid << endl;
+  return 0;
+}
+
 int main(int argc, char **argv) {
   cxxopts::Options options("dart-inject", "Injects code into a running DartVM process");
 
@@ -108,7 +1438,28 @@ int main(int argc, char **argv) {
     ("h,help", "Print help")
     ("p,pid", "Dart process id", cxxopts::value<int>(), "N")
     ("v,verbose", "Enable debug prints")
-    ("l,antman", "Override antman location");
+    ("l,antman", "Override antman location")
+    ("ptrace", "Load antman with a minimal ptrace loader instead of liblldb")
+    ("timings", "Print the time spent in each phase as a table or json",
+      cxxopts::value<string>()->implicit_value("table"), "FORMAT")
+    ("compile-local", "Compile spawned scripts with the local Dart SDK and send the kernel to the target")
+    ("dart", "Dart executable used by --compile-local", cxxopts::value<string>()->default_value("dart"), "PATH")
+    ("instances", "Number of isolates a spawn runs the script in, sharing one compiled kernel",
+      cxxopts::value<int>()->default_value("1"), "N")
+    ("all", "Run the command in every process running the Dart VM")
+    ("match", "Run the command in every Dart process whose command line matches REGEX",
+      cxxopts::value<string>(), "REGEX")
+    ("detach-early", "Only load antman while the target is stopped, send the command after detaching")
+    ("stop-budget", "Abort the injection once the target was stopped for longer than MS milliseconds",
+      cxxopts::value<int64_t>(), "MS")
+    ("no-attach", "Never stop the target, only use the control channel of an antman that is already running")
+    ("expressions", "Call into the target through lldb's expression evaluator instead of directly (x86_64)")
+    ("format", "Output format of info: text, json or msgpack, all with a schema version. Of watch: csv or columnar",
+      cxxopts::value<string>()->default_value("text"), "FORMAT")
+    ("interval", "Time between the samples of watch", cxxopts::value<string>()->default_value("100ms"), "DURATION")
+    ("duration", "How long watch samples for", cxxopts::value<string>()->default_value("10s"), "DURATION")
+    ("o,output", "File watch writes to instead of stdout", cxxopts::value<string>(), "FILE")
+    ("f,follow", "With tail, keep printing new log records until interrupted. With spawn, print what the script prints until its main returns");
 
   options.add_options("_")
     ("positional", "", cxxopts::value<std::vector<string>>());
@@ -125,7 +1476,18 @@ int main(int argc, char **argv) {
 
       cout << options.help({""}) << endl;
       cout << "Commands:" << endl;
-      cout << "  spawn [uri]  Spawns the target URI as a new isolate" << endl;
+      cout << "  spawn [uri]  Spawns the target URI (.dart or precompiled .dill) as a new isolate" << endl;
+      cout << "  spawn-source [file] [library...]" << endl;
+      cout << "               Sends the script and its libraries as source and spawns it" << endl;
+      cout << "  info         Prints the VM version and isolates" << endl;
+      cout << "  pool [size]  Keeps [size] idle isolates ready for spawns" << endl;
+      cout << "  status [id]  Prints the state, error and phase timings of a spawn, fails if it failed" << endl;
+      cout << "  batch [command...] | batch [file]" << endl;
+      cout << "               Runs several commands in one attach and round trip" << endl;
+      cout << "  daemon       Stays attached and serves commands from a unix socket" << endl;
+      cout << "  list         Lists the processes running the Dart VM" << endl;
+      cout << "  tail         Prints antman's log without stopping the target, see --follow" << endl;
+      cout << "  watch        Samples isolate states, see --interval, --duration and --format" << endl;
       return 0;
     }
 
@@ -155,59 +1517,230 @@ int main(int argc, char **argv) {
       antmanLibPath = cwd + "/" + antmanLibPath;
     }
 
-    auto &pargs = arg["positional"].as<std::vector<string>>();
+    string timingsFormat;
+    if (arg.count("timings")) {
+      timingsFormat = arg["timings"].as<string>();
+      if (timingsFormat != "table" && timingsFormat != "json") {
+        cerr << "Error: Unknown timings format '" << timingsFormat << "'." << endl;
+        return 1;
+      }
+    }
 
-    lldb::SBDebugger::Initialize();
-    antmanInjector injector;
+    auto pargs = arg["positional"].as<std::vector<string>>();
+    bool daemon = pargs[0] == "daemon";
+    InjectOptions injectOptions;
+    injectOptions.antmanLibPath = antmanLibPath;
+    injectOptions.usePtrace = arg.count("ptrace") > 0;
+    injectOptions.detachEarly = arg.count("detach-early") > 0;
+    if (arg.count("stop-budget")) {
+      auto budget = arg["stop-budget"].as<int64_t>();
+      if (budget <= 0 || budget > INT64_MAX / 1000) {
+        cerr << "Error: --stop-budget must be a positive number of milliseconds." << endl;
+        return 1;
+      }
+      injectOptions.stopBudgetMicros = budget * 1000;
+    }
+    injectOptions.noAttach = arg.count("no-attach") > 0;
+    injectOptions.useExpressions = arg.count("expressions") > 0;
+    bool many = arg.count("all") || arg.count("match");
 
-    if (pid == -1) {
-      injector.runCmd("process attach -n dart");
-    } else {
-      injector.runCmd("process attach -p " + to_string(pid));
+    if (many && (pid != -1 || daemon)) {
+      cerr << "Error: --all and --match can't be used with -p or daemon." << endl;
+      return 1;
     }
-    injector.updateTarget();
 
-    injector.runCmd("expr (void*)dlopen(\"" + antmanLibPath + "\", 0x2)");
-    injector.runCmd("expr antmanInit()");
+    PhaseTimer timer;
+
+    if (pargs[0] == "list") {
+      if (pargs.size() != 1 || pid != -1 || many) {
+        cerr << "Error: list takes no arguments or targets." << endl;
+        return 1;
+      }
 
-    auto debugger = lldb::SBDebugger::Create(false);
+      auto phase = timer.phase("discovery");
+      auto processes = discoverDartProcesses();
+      phase.finish();
 
-    if (!debugger.IsValid()) {
-      cerr << "Error: Failed to create debugger." << endl;
+      cout << listTable(processes) << endl;
+      if (!timingsFormat.empty()) cout << (timingsFormat == "json" ? timer.json() : timer.table()) << endl;
+      return 0;
+    }
+
+    bool follow = arg.count("follow") > 0;
+    if (follow && (many || (pargs[0] != "tail" && pargs[0] != "spawn" && pargs[0] != "spawn-source"))) {
+      cerr << "Error: --follow only works with tail, spawn and spawn-source on a single target." << endl;
       return 1;
     }
 
-    // SPAWN //
-    if (pargs[0] == "spawn") {
-      if (pargs.size() != 2) {
-        cerr << "Error: Wrong number of arguments." << endl;
+    if (pargs[0] == "tail") {
+      if (pargs.size() != 1 || many) {
+        cerr << "Error: tail takes no arguments and a single target." << endl;
         return 1;
       }
 
-      std::string scriptPath = pargs[1];
-      if (scriptPath[0] != '/') {
-        scriptPath = cwd + "/" + scriptPath;
+      if (pid == -1) pid = defaultTarget(discoverDartProcesses());
+      return tailLog(pid, follow);
+    }
+
+    if (daemon) {
+      if (pargs.size() != 1) {
+        cerr << "Error: Wrong number of arguments." << endl;
+        return 1;
       }
 
-      if (access(scriptPath.c_str(), F_OK) == -1) {
-        throw InjectionError("Script file not found: '" + scriptPath + "'");
+      if (injectOptions.usePtrace) {
+        cerr << "Error: --ptrace can't be used with daemon." << endl;
+        return 1;
       }
 
-      injector.runCmd("expr antmanSpawn(\"" + scriptPath + "\")");
+      if (pid == -1) pid = defaultTarget(discoverDartProcesses());
 
-    // INFO //
-    } else if (pargs[0] == "info") {
-      if (pargs.size() != 1) {
-        cerr << "Error: Wrong number of arguments." << endl;
+      string loadedPath;
+      auto state = antmanState(pid, loadedPath);
+
+      auto phase = timer.phase("debugger create");
+      lldb::SBDebugger::Initialize();
+      antmanInjector injector;
+      loadWithLldb(injector, pid, injectOptions, state, loadedPath, phase);
+      phase.finish();
+      return runDaemon(injector);
+    }
+
+    auto instances = arg["instances"].as<int>();
+    if (instances < 1 || static_cast<uint64_t>(instances) > antmanInstancesLimit) {
+      cerr << "Error: --instances must be between 1 and " << antmanInstancesLimit << "." << endl;
+      return 1;
+    }
+
+    auto format = arg["format"].as<string>();
+    if (pargs[0] == "watch") {
+      if (pargs.size() != 1 || many) {
+        cerr << "Error: watch takes no arguments and a single target." << endl;
+        return 1;
+      }
+      if (format != "text" && format != "csv" && format != "columnar") {
+        cerr << "Error: watch writes csv or columnar." << endl;
         return 1;
       }
 
-      auto infoStr = injector.strExpr("(intptr_t)antmanInfo()");
-      cout << infoStr << endl;
-    } else {
-      cerr << "Error: Unknown command '" << pargs[0] << "'." << endl;
+      auto interval = parseDuration(arg["interval"].as<string>());
+      auto duration = parseDuration(arg["duration"].as<string>());
+      if (interval < static_cast<int64_t>(antmanWatchIntervalMin)) throw InjectionError("The watch interval must be at least 1ms");
+      pargs = {"watch", to_string(interval), to_string(duration)};
+    }
+
+    if (!prepareCommand(pargs, cwd, instances)) return 1;
+
+    // info is formatted by antman, binary output can't be prefixed per target.
+    InfoFormat infoFormat;
+    if (pargs[0] != "watch" && !parseInfoFormat(format, infoFormat)) {
+      cerr << "Error: Unknown format '" << format << "'." << endl;
       return 1;
     }
+    if (pargs[0] != "watch" && format != "text") {
+      if (pargs[0] != "info" || (many && infoFormat == InfoFormat::msgpack)) {
+        cerr << "Error: --format only applies to info, and msgpack to a single target." << endl;
+        return 1;
+      }
+      pargs.push_back(format);
+    }
+
+    if (arg.count("compile-local") && pargs[0] == "spawn") {
+      int fd;
+      if (isKernelPath(pargs[1])) {
+        fd = open(pargs[1].c_str(), O_RDONLY | O_CLOEXEC);
+      } else {
+        auto dart = arg["dart"].as<string>();
+        auto phase = timer.phase("discovery");
+        auto processes = discoverDartProcesses();
+        std::vector<int> pids;
+        if (many) {
+          pids = findTargets(processes, arg.count("all") > 0, arg.count("match") ? arg["match"].as<string>() : "");
+        } else {
+          if (pid == -1) pid = defaultTarget(processes);
+          pids = {pid};
+        }
+
+        phase.next("local compile", false);
+        checkLocalVersion(dart, processes, pids);
+        fd = compileKernel(dart, pargs[1]);
+      }
+      if (fd == -1) throw InjectionError("Failed to open '" + pargs[1] + "': " + strerror(errno));
+      pargs = {"spawn-kernel", pargs[1], pargs[2], to_string(fd)};
+    }
+
+    if (many) {
+      auto phase = timer.phase("discovery");
+      auto pids = findTargets(discoverDartProcesses(), arg.count("all") > 0,
+                              arg.count("match") ? arg["match"].as<string>() : "");
+      phase.finish();
+      if (pids.empty()) throw InjectionError("No matching processes found");
+
+      auto results = injectAll(pids, pargs, injectOptions, !timingsFormat.empty());
+
+      // Output lines are prefixed with the pid so results can be told apart.
+      int failed = 0;
+      for (auto& result : results) {
+        auto prefix = "[" + to_string(result.pid) + "] ";
+        if (!result.ok) {
+          cerr << prefix << "Injection error: " << result.output << endl;
+          failed++;
+          continue;
+        }
+
+        std::istringstream lines(result.output);
+        string line;
+        while (std::getline(lines, line)) cout << prefix << line << endl;
+
+        if (injectOptions.detachEarly || injectOptions.stopBudgetMicros > 0) {
+          cerr << prefix << "Target stopped for " << std::fixed << std::setprecision(3)
+               << result.timer.stoppedMicros() / 1000.0 << " ms" << endl;
+        }
+      }
+
+      if (timingsFormat == "json") {
+        cout << "{\"discovery\":" << timer.json();
+        for (auto& result : results) cout << ",\"" << result.pid << "\":" << result.timer.json();
+        cout << '}' << endl;
+      } else if (!timingsFormat.empty()) {
+        cout << timer.table() << endl;
+        for (auto& result : results) cout << endl << "[" << result.pid << "]" << endl << result.timer.table() << endl;
+      }
+
+      if (failed) cerr << "Failed in " << failed << " of " << results.size() << " processes" << endl;
+      return failed ? 1 : 0;
+    }
+
+    if (pid == -1) {
+      auto phase = timer.phase("discovery");
+      pid = defaultTarget(discoverDartProcesses());
+    }
+
+    auto output = injectCommand(pid, pargs, injectOptions, timer);
+    if (injectOptions.detachEarly || injectOptions.stopBudgetMicros > 0) {
+      cerr << "Target stopped for " << std::fixed << std::setprecision(3) << timer.stoppedMicros() / 1000.0 << " ms" << endl;
+    }
+
+    if (pargs[0] == "watch") {
+      std::ofstream file;
+      if (arg.count("output")) {
+        file.open(arg["output"].as<string>(), std::ios::binary);
+        if (!file) throw InjectionError("Failed to open '" + arg["output"].as<string>() + "'");
+      }
+      receiveWatch(pid, format == "columnar", arg.count("output") ? file : cout);
+    } else if (follow && output.compare(0, 6, "Spawn ") == 0) {
+      followSpawn(pid, output.substr(6));
+    } else if (format == "msgpack") {
+      cout.write(output.data(), static_cast<std::streamsize>(output.size()));
+    } else if (!output.empty()) {
+      cout << output << endl;
+    }
+
+    if (!timingsFormat.empty()) {
+      appendSpawnTimings(pid, output, timer);
+
+      cout << (timingsFormat == "json" ? timer.json() : timer.table()) << endl;
+    }
   } catch (const cxxopts::OptionException& e) {
     cerr << "Error: " << e.what() << endl;
     return 1;
@@ -215,4 +1748,4 @@ int main(int argc, char **argv) {
     cerr << "Injection error: " << e.what << endl;
     return 1;
   }
-}
\ No newline at end of file
+}
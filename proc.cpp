@@ -0,0 +1,333 @@
+#include "proc.h"
+#include "inject.h"
+
+#include <fstream>
+#include <algorithm>
+#include <sstream>
+#include <map>
+#include <mutex>
+#include <cstring>
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+using std::string;
+using std::to_string;
+
+std::vector<MapEntry> readMaps(int pid) {
+  std::ifstream file("/proc/" + to_string(pid) + "/maps");
+  if (!file) throw InjectionError("Failed to read maps of process " + to_string(pid));
+
+  std::vector<MapEntry> maps;
+  string line;
+  while (std::getline(file, line)) {
+    MapEntry entry;
+    string range, dev, inode;
+    std::istringstream stream(line);
+    stream >> range >> entry.perms >> std::hex >> entry.offset >> dev >> inode;
+    std::getline(stream >> std::ws, entry.path);
+
+    auto dash = range.find('-');
+    entry.start = std::stoull(range.substr(0, dash), nullptr, 16);
+    entry.end = std::stoull(range.substr(dash + 1), nullptr, 16);
+    maps.push_back(std::move(entry));
+  }
+  return maps;
+}
+
+std::vector<int> listProcesses() {
+  std::vector<int> pids;
+  DIR* dir = opendir("/proc");
+  if (dir == nullptr) throw InjectionError("Failed to list /proc: " + string(strerror(errno)));
+
+  auto self = getpid();
+  while (auto entry = readdir(dir)) {
+    char* end;
+    auto pid = static_cast<int>(strtol(entry->d_name, &end, 10));
+    if (*end == '\0' && pid > 0 && pid != self) pids.push_back(pid);
+  }
+  closedir(dir);
+  return pids;
+}
+
+string processName(int pid) {
+  std::ifstream file("/proc/" + to_string(pid) + "/comm");
+  string name;
+  std::getline(file, name);
+  return name;
+}
+
+string processCommandLine(int pid) {
+  std::ifstream file("/proc/" + to_string(pid) + "/cmdline", std::ios::binary);
+  std::ostringstream content;
+  content << file.rdbuf();
+
+  auto cmdline = content.str();
+  while (!cmdline.empty() && cmdline.back() == '\0') cmdline.pop_back();
+  std::replace(cmdline.begin(), cmdline.end(), '\0', ' ');
+  return cmdline;
+}
+
+string targetPath(int pid, const string& path) {
+  return "/proc/" + to_string(pid) + "/root" + path;
+}
+
+ElfFile::ElfFile(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) throw InjectionError("Failed to open '" + path + "': " + strerror(errno));
+
+  struct stat st = {};
+  fstat(fd, &st);
+  size = static_cast<size_t>(st.st_size);
+
+  void* map = size >= sizeof(Elf64_Ehdr) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+
+  if (map == MAP_FAILED) throw InjectionError("Failed to map '" + path + "'");
+  data = reinterpret_cast<const uint8_t*>(map);
+
+  auto header = reinterpret_cast<const Elf64_Ehdr*>(data);
+  if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64) {
+    munmap(const_cast<uint8_t*>(data), size);
+    throw InjectionError("Not a 64-bit ELF file: '" + path + "'");
+  }
+}
+
+ElfFile::~ElfFile() {
+  munmap(const_cast<uint8_t*>(data), size);
+}
+
+bool ElfFile::findSymbol(const string& name, uint64_t& value) const {
+  auto header = reinterpret_cast<const Elf64_Ehdr*>(data);
+  if (header->e_shoff == 0 || header->e_shoff + header->e_shnum * sizeof(Elf64_Shdr) > size) return false;
+  auto sections = reinterpret_cast<const Elf64_Shdr*>(data + header->e_shoff);
+
+  for (Elf64_Word type : {SHT_DYNSYM, SHT_SYMTAB}) {
+    for (int i = 0; i < header->e_shnum; i++) {
+      auto& section = sections[i];
+      if (section.sh_type != type || section.sh_link >= header->e_shnum) continue;
+
+      auto& strings = sections[section.sh_link];
+      if (section.sh_offset + section.sh_size > size || strings.sh_offset + strings.sh_size > size) continue;
+
+      auto symbols = reinterpret_cast<const Elf64_Sym*>(data + section.sh_offset);
+      auto names = reinterpret_cast<const char*>(data + strings.sh_offset);
+      auto count = section.sh_size / sizeof(Elf64_Sym);
+
+      for (size_t j = 0; j < count; j++) {
+        auto& symbol = symbols[j];
+        if (symbol.st_shndx == SHN_UNDEF || symbol.st_name >= strings.sh_size) continue;
+        if (strcmp(names + symbol.st_name, name.c_str()) == 0) {
+          value = symbol.st_value;
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+uint64_t ElfFile::firstLoadAddress() const {
+  auto header = reinterpret_cast<const Elf64_Ehdr*>(data);
+  if (header->e_phoff + header->e_phnum * sizeof(Elf64_Phdr) > size) return 0;
+  auto segments = reinterpret_cast<const Elf64_Phdr*>(data + header->e_phoff);
+
+  for (int i = 0; i < header->e_phnum; i++) {
+    if (segments[i].p_type == PT_LOAD) return segments[i].p_vaddr & ~static_cast<uint64_t>(segments[i].p_align - 1);
+  }
+  return 0;
+}
+
+string ElfFile::buildId() const {
+  auto header = reinterpret_cast<const Elf64_Ehdr*>(data);
+  if (header->e_phoff + header->e_phnum * sizeof(Elf64_Phdr) > size) return "";
+  auto segments = reinterpret_cast<const Elf64_Phdr*>(data + header->e_phoff);
+
+  for (int i = 0; i < header->e_phnum; i++) {
+    auto& segment = segments[i];
+    if (segment.p_type != PT_NOTE || segment.p_offset + segment.p_filesz > size) continue;
+
+    // Notes are a header, the name and the descriptor, each padded to 4 bytes.
+    size_t pos = segment.p_offset;
+    auto end = segment.p_offset + segment.p_filesz;
+    while (pos + sizeof(Elf64_Nhdr) <= end) {
+      auto note = reinterpret_cast<const Elf64_Nhdr*>(data + pos);
+      auto name = pos + sizeof(Elf64_Nhdr);
+      auto desc = name + ((note->n_namesz + 3) & ~3u);
+      pos = desc + ((note->n_descsz + 3) & ~3u);
+      if (pos > end) break;
+
+      if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(data + name, "GNU", 4) == 0) {
+        static const char digits[] = "0123456789abcdef";
+        string id;
+        for (size_t j = 0; j < note->n_descsz; j++) {
+          id += digits[data[desc + j] >> 4];
+          id += digits[data[desc + j] & 0xf];
+        }
+        return id;
+      }
+    }
+  }
+  return "";
+}
+
+string baseName(const string& path) {
+  auto slash = path.rfind('/');
+  return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+uintptr_t findModule(const std::vector<MapEntry>& maps, const std::vector<string>& prefixes, string& path) {
+  for (auto& prefix : prefixes) {
+    for (auto& entry : maps) {
+      if (entry.offset != 0 || entry.path.empty() || entry.path[0] != '/') continue;
+      if (baseName(entry.path).compare(0, prefix.size(), prefix) == 0) {
+        path = entry.path;
+        return entry.start;
+      }
+    }
+  }
+  path.clear();
+  return 0;
+}
+
+// The file to read a module's symbols from. A library that was replaced on
+// disk after it was loaded shows up as "<path> (deleted)", the mapped file is
+// still reachable through /proc/<pid>/map_files.
+static string moduleFile(int pid, const std::vector<MapEntry>& maps, uintptr_t start, const string& path) {
+  static const string deleted = " (deleted)";
+  if (path.size() <= deleted.size() || path.compare(path.size() - deleted.size(), deleted.size(), deleted) != 0) {
+    return targetPath(pid, path);
+  }
+
+  for (auto& entry : maps) {
+    if (entry.start != start) continue;
+    std::ostringstream range;
+    range << std::hex << entry.start << '-' << entry.end;
+    return "/proc/" + to_string(pid) + "/map_files/" + range.str();
+  }
+  return targetPath(pid, path);
+}
+
+namespace {
+
+struct CachedSymbol {
+  bool found;
+  uint64_t value;
+  uint64_t firstLoadAddress;
+  bool relocatable;
+};
+
+}
+
+// Lookups keyed on the module's build-id and the symbol name, so a library
+// shared by many targets (or injected into the same one again) has its
+// symbol tables scanned once.
+static std::mutex symbolCacheMutex;
+static std::map<string, CachedSymbol> symbolCache;
+
+uintptr_t findRemoteSymbol(int pid, const std::vector<MapEntry>& maps,
+                           const std::vector<string>& prefixes, const string& symbol) {
+  for (auto& prefix : prefixes) {
+    string path;
+    auto start = findModule(maps, {prefix}, path);
+    if (path.empty()) continue;
+
+    ElfFile elf(moduleFile(pid, maps, start, path));
+    auto buildId = elf.buildId();
+    auto key = buildId + '\0' + symbol;
+
+    CachedSymbol cached = {};
+    bool hit = false;
+    if (!buildId.empty()) {
+      std::lock_guard<std::mutex> lock(symbolCacheMutex);
+      auto it = symbolCache.find(key);
+      if (it != symbolCache.end()) {
+        cached = it->second;
+        hit = true;
+      }
+    }
+
+    if (!hit) {
+      auto header = reinterpret_cast<const Elf64_Ehdr*>(elf.data);
+      cached.found = elf.findSymbol(symbol, cached.value);
+      cached.firstLoadAddress = elf.firstLoadAddress();
+      cached.relocatable = header->e_type == ET_DYN;
+
+      if (!buildId.empty()) {
+        std::lock_guard<std::mutex> lock(symbolCacheMutex);
+        symbolCache[key] = cached;
+      }
+    }
+
+    if (cached.found) {
+      auto bias = cached.relocatable ? start - cached.firstLoadAddress : 0;
+      return bias + cached.value;
+    }
+  }
+  return 0;
+}
+
+const std::vector<string> libdlModules = {"libdl.so", "libdl-", "libc.so", "libc-"};
+const std::vector<string> libcModules = {"libc.so", "libc-"};
+
+uintptr_t findRemoteDlopen(int pid, const std::vector<MapEntry>& maps, uint64_t& flags) {
+  auto address = findRemoteSymbol(pid, maps, libdlModules, "dlopen");
+  if (address == 0) {
+    address = findRemoteSymbol(pid, maps, libcModules, "__libc_dlopen_mode");
+    flags |= RTLD_DLOPEN_PRIVATE;
+  }
+  return address;
+}
+
+bool readRemoteMemory(int pid, uintptr_t address, void* data, size_t size) {
+  iovec local = {data, size};
+  iovec remote = {reinterpret_cast<void*>(address), size};
+  if (process_vm_readv(pid, &local, 1, &remote, 1, 0) == static_cast<ssize_t>(size)) return true;
+
+  // process_vm_readv isn't allowed everywhere, /proc/<pid>/mem has the same permission checks.
+  int fd = open(("/proc/" + to_string(pid) + "/mem").c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  bool ok = pread(fd, data, size, static_cast<off_t>(address)) == static_cast<ssize_t>(size);
+  close(fd);
+  return ok;
+}
+
+bool readRemoteString(int pid, uintptr_t address, string& str) {
+  str.clear();
+  while (true) {
+    char chunk[4096];
+    auto size = sizeof(chunk) - address % sizeof(chunk);
+    if (!readRemoteMemory(pid, address, chunk, size)) return false;
+
+    auto end = static_cast<const char*>(memchr(chunk, '\0', size));
+    str.append(chunk, end != nullptr ? static_cast<size_t>(end - chunk) : size);
+    if (end != nullptr) return true;
+    address += size;
+  }
+}
+
+int openRemoteMemfd(int pid, const string& name) {
+  auto dirPath = "/proc/" + to_string(pid) + "/fd";
+  DIR* dir = opendir(dirPath.c_str());
+  if (dir == nullptr) return -1;
+
+  // memfds link to "/memfd:<name> (deleted)".
+  auto target = "/memfd:" + name + " (deleted)";
+  int fd = -1;
+  while (auto entry = readdir(dir)) {
+    auto path = dirPath + "/" + entry->d_name;
+    char link[256];
+    auto length = readlink(path.c_str(), link, sizeof(link));
+    if (length != static_cast<ssize_t>(target.size()) || target.compare(0, target.size(), link, length) != 0) continue;
+
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) break;
+  }
+  closedir(dir);
+  return fd;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+struct MapEntry {
+  uintptr_t start;
+  uintptr_t end;
+  uint64_t offset;
+  std::string perms;
+  std::string path;
+};
+
+// Parses /proc/<pid>/maps.
+std::vector<MapEntry> readMaps(int pid);
+
+// Pids of every process in /proc except our own.
+std::vector<int> listProcesses();
+
+// The short process name from /proc/<pid>/comm, empty if it is gone.
+std::string processName(int pid);
+
+// The command line from /proc/<pid>/cmdline with the arguments joined by spaces.
+std::string processCommandLine(int pid);
+
+// The file name after the last slash.
+std::string baseName(const std::string& path);
+
+// Resolves a path from the target's point of view, going through
+// /proc/<pid>/root so it also works for processes in another mount namespace.
+std::string targetPath(int pid, const std::string& path);
+
+// A read-only mapping of a 64-bit ELF file used to look up symbols.
+struct ElfFile {
+  explicit ElfFile(const std::string& path);
+  ~ElfFile();
+
+  ElfFile(const ElfFile&) = delete;
+  ElfFile& operator=(const ElfFile&) = delete;
+
+  // Looks in the dynamic symbol table and then the static one, value is the
+  // symbol's unrelocated address.
+  bool findSymbol(const std::string& name, uint64_t& value) const;
+
+  // Lowest virtual address of a PT_LOAD segment, used to find the load bias.
+  uint64_t firstLoadAddress() const;
+
+  // The GNU build-id note as lowercase hex, empty if there is none.
+  std::string buildId() const;
+
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+};
+
+// Returns the load bias of the first module in maps whose file name starts
+// with one of the prefixes, or 0 and an empty path if none is mapped.
+uintptr_t findModule(const std::vector<MapEntry>& maps, const std::vector<std::string>& prefixes, std::string& path);
+
+// Returns the runtime address of a symbol in the first matching module, or 0.
+// Lookups are cached per build-id.
+uintptr_t findRemoteSymbol(int pid, const std::vector<MapEntry>& maps,
+                           const std::vector<std::string>& prefixes, const std::string& symbol);
+
+// Module name prefixes of the libraries glibc's dl functions live in. Before
+// glibc 2.34 they are in libdl, since then in libc.
+extern const std::vector<std::string> libdlModules;
+extern const std::vector<std::string> libcModules;
+
+// glibc's private flag that makes __libc_dlopen_mode behave like dlopen.
+constexpr uint64_t RTLD_DLOPEN_PRIVATE = 0x80000000;
+
+// Finds dlopen in the target. Before glibc 2.34 it lives in libdl, which
+// isn't always loaded, in that case __libc_dlopen_mode is returned and the
+// private flag is added to flags.
+uintptr_t findRemoteDlopen(int pid, const std::vector<MapEntry>& maps, uint64_t& flags);
+
+// Reads memory of another process, returns false if it can't be read.
+bool readRemoteMemory(int pid, uintptr_t address, void* data, size_t size);
+
+// Reads a NUL-terminated string from another process, a page at a time so it
+// never reads past the page the string ends in.
+bool readRemoteString(int pid, uintptr_t address, std::string& str);
+
+// Stack layout for calling a function on a hijacked x86_64 thread, shared by
+// the ptrace loader and the debugger's direct calls. Strings for the call are
+// pushed below the interrupted stack pointer minus the red zone, the call's
+// own stack starts below them.
+namespace remote_call {
+
+// Bytes below the stack pointer that the interrupted code may still be using.
+constexpr uintptr_t redZone = 128;
+
+// Value for orig_rax that keeps the kernel from restarting a syscall the
+// thread was stopped in.
+constexpr uint64_t noSyscallRestart = static_cast<uint64_t>(-1);
+
+inline uintptr_t scratchBase(uintptr_t stackPointer) {
+  return stackPointer - redZone;
+}
+
+// Room for a NUL-terminated string below scratch, 16 byte aligned.
+inline uintptr_t pushString(uintptr_t scratch, size_t length) {
+  return (scratch - (length + 1)) & ~static_cast<uintptr_t>(15);
+}
+
+// The stack pointer at the callee's entry: 16 byte aligned below scratch
+// with a gap, minus the return address the caller's call would have pushed.
+inline uintptr_t callStack(uintptr_t scratch) {
+  return ((scratch - 64) & ~static_cast<uintptr_t>(15)) - 8;
+}
+
+}
+
+// Opens a memfd the process holds a descriptor to, read-only. Returns -1 if
+// there is none with that name or we may not open it.
+int openRemoteMemfd(int pid, const std::string& name);
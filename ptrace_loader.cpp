@@ -0,0 +1,227 @@
+#include "ptrace_loader.h"
+#include "proc.h"
+#include "inject.h"
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <csignal>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::to_string;
+
+#if defined(__x86_64__)
+
+// A single thread of the target stopped under ptrace. Its registers are saved
+// on attach and put back when it is released, calls made through it return
+// to address 0 so they end in a SIGSEGV stop we can catch.
+struct RemoteThread {
+  explicit RemoteThread(int tid) : tid(tid) {
+    if (ptrace(PTRACE_SEIZE, tid, nullptr, nullptr) == -1) {
+      throw InjectionError("Failed to seize thread " + to_string(tid) + ": " + strerror(errno));
+    }
+
+    attached = true;
+    if (ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr) == -1) {
+      throw InjectionError("Failed to interrupt thread " + to_string(tid) + ": " + strerror(errno));
+    }
+
+    int status = waitStop();
+    if (status >> 16 != PTRACE_EVENT_STOP) pendingSignals.push_back(WSTOPSIG(status));
+
+    if (ptrace(PTRACE_GETREGS, tid, nullptr, &savedRegs) == -1 ||
+        ptrace(PTRACE_GETFPREGS, tid, nullptr, &savedFpRegs) == -1) {
+      throw InjectionError("Failed to read registers: " + string(strerror(errno)));
+    }
+
+    saved = true;
+    scratch = remote_call::scratchBase(savedRegs.rsp);
+  }
+
+  ~RemoteThread() {
+    release();
+  }
+
+  // Restores the thread, detaches and re-raises any signals that arrived
+  // while it was hijacked.
+  void release() {
+    if (!attached) return;
+    if (saved) {
+      ptrace(PTRACE_SETREGS, tid, nullptr, &savedRegs);
+      ptrace(PTRACE_SETFPREGS, tid, nullptr, &savedFpRegs);
+    }
+    ptrace(PTRACE_DETACH, tid, nullptr, nullptr);
+    attached = false;
+
+    for (auto sig : pendingSignals) {
+      syscall(SYS_tgkill, pidOf(tid), tid, sig);
+    }
+  }
+
+  // Copies a string below the saved stack pointer, returns its address.
+  uintptr_t pushString(const string& str) {
+    scratch = remote_call::pushString(scratch, str.size());
+    writeMemory(scratch, str.c_str(), str.size() + 1);
+    return scratch;
+  }
+
+  string readString(uintptr_t address) {
+    string str;
+    if (!readRemoteString(tid, address, str)) throw InjectionError("Failed to read string from target");
+    return str;
+  }
+
+  uint64_t call(uintptr_t function, std::initializer_list<uint64_t> args) {
+    auto regs = savedRegs;
+    regs.rsp = remote_call::callStack(scratch);
+    regs.rip = function;
+    regs.rax = 0;
+    regs.orig_rax = remote_call::noSyscallRestart;
+
+    decltype(regs.rdi)* argRegs[] = {&regs.rdi, &regs.rsi, &regs.rdx, &regs.rcx, &regs.r8, &regs.r9};
+    size_t i = 0;
+    for (auto arg : args) *argRegs[i++] = arg;
+
+    uint64_t returnAddress = 0;
+    writeMemory(regs.rsp, &returnAddress, sizeof(returnAddress));
+
+    if (ptrace(PTRACE_SETREGS, tid, nullptr, &regs) == -1) {
+      throw InjectionError("Failed to set registers: " + string(strerror(errno)));
+    }
+
+    ptrace(PTRACE_CONT, tid, nullptr, nullptr);
+    while (true) {
+      int status = waitStop();
+      int sig = WSTOPSIG(status);
+
+      if (status >> 16 == PTRACE_EVENT_STOP) {
+        ptrace(PTRACE_CONT, tid, nullptr, nullptr);
+        continue;
+      }
+
+      if (sig == SIGSEGV) {
+        ptrace(PTRACE_GETREGS, tid, nullptr, &regs);
+        if (regs.rip == returnAddress) return regs.rax;
+        throw InjectionError("Target crashed during remote call at 0x" + toHex(regs.rip));
+      }
+
+      pendingSignals.push_back(sig);
+      ptrace(PTRACE_CONT, tid, nullptr, nullptr);
+    }
+  }
+
+  int tid;
+
+private:
+  int waitStop() {
+    int status;
+    while (true) {
+      if (waitpid(tid, &status, __WALL) == -1) {
+        if (errno == EINTR) continue;
+        throw InjectionError("Failed to wait for thread " + to_string(tid) + ": " + strerror(errno));
+      }
+      if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        attached = false;
+        throw InjectionError("Target exited during injection");
+      }
+      if (WIFSTOPPED(status)) return status;
+    }
+  }
+
+  void writeMemory(uintptr_t address, const void* data, size_t size) {
+    iovec local = {const_cast<void*>(data), size};
+    iovec remote = {reinterpret_cast<void*>(address), size};
+    if (process_vm_writev(tid, &local, 1, &remote, 1, 0) == static_cast<ssize_t>(size)) return;
+
+    // Fall back to poking word by word, e.g. when the kernel lacks process_vm_writev.
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    for (size_t offset = 0; offset < size; offset += sizeof(long)) {
+      auto target = address + offset;
+      errno = 0;
+      long word = ptrace(PTRACE_PEEKDATA, tid, target, nullptr);
+      if (errno != 0) throw InjectionError("Failed to write target memory: " + string(strerror(errno)));
+      memcpy(&word, bytes + offset, std::min(sizeof(long), size - offset));
+      ptrace(PTRACE_POKEDATA, tid, target, word);
+    }
+  }
+
+  static int pidOf(int tid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", tid);
+    FILE* file = fopen(path, "r");
+    int tgid = tid;
+    if (file) {
+      char line[256];
+      while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "Tgid: %d", &tgid) == 1) break;
+      }
+      fclose(file);
+    }
+    return tgid;
+  }
+
+  static string toHex(uint64_t value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llx", static_cast<unsigned long long>(value));
+    return buf;
+  }
+
+  bool attached = false;
+  bool saved = false;
+  user_regs_struct savedRegs = {};
+  user_fpregs_struct savedFpRegs = {};
+  uintptr_t scratch = 0;
+  std::vector<int> pendingSignals;
+};
+
+void ptraceLoad(int pid, const string& antmanLibPath, PhaseTimer& timer) {
+  uint64_t flags = RTLD_NOW;
+  uintptr_t dlopenAddr, dlerrorAddr;
+  {
+    auto phase = timer.phase("resolve dlopen");
+    auto maps = readMaps(pid);
+    dlopenAddr = findRemoteDlopen(pid, maps, flags);
+    if (dlopenAddr == 0) throw InjectionError("Could not find dlopen in target");
+
+    dlerrorAddr = findRemoteSymbol(pid, maps, libdlModules, "dlerror");
+  }
+
+  if (verbose) cout << "Resolved dlopen at 0x" << std::hex << dlopenAddr << std::dec << endl;
+
+  auto phase = timer.phase("seize thread", true);
+  RemoteThread thread(pid);
+  phase.next("dlopen", true);
+
+  auto path = thread.pushString(antmanLibPath);
+  auto handle = thread.call(dlopenAddr, {path, flags});
+  if (handle == 0) {
+    string message = dlerrorAddr ? thread.readString(thread.call(dlerrorAddr, {})) : "unknown error";
+    throw InjectionError("dlopen failed in target: " + message);
+  }
+
+  phase.next("antmanInit", true);
+  auto maps = readMaps(pid);
+  auto initAddr = findRemoteSymbol(pid, maps, {baseName(antmanLibPath)}, "antmanInit");
+  if (initAddr == 0) throw InjectionError("Could not find antmanInit in '" + antmanLibPath + "'");
+  thread.call(initAddr, {});
+
+  phase.next("restore and detach", true);
+  thread.release();
+}
+
+#else
+
+void ptraceLoad(int pid, const string& antmanLibPath, PhaseTimer& timer) {
+  throw InjectionError("The ptrace loader only supports x86_64");
+}
+
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+#include "timing.h"
+
+// Loads antman into a process without liblldb: seizes one thread with ptrace,
+// makes it call dlopen and antmanInit, then restores it and detaches. Only
+// the hijacked thread is stopped, and only for the duration of the calls.
+void ptraceLoad(int pid, const std::string& antmanLibPath, PhaseTimer& timer);
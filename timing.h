@@ -0,0 +1,137 @@
+#pragma once
+
+// Phase timings shared by dart-inject and antman, antman sends its phases to
+// the injector as tab separated lines.
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <cstdint>
+
+inline int64_t nowMicros() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct PhaseTiming {
+  std::string name;
+  int64_t wallMicros;
+  int64_t stoppedMicros;
+};
+
+struct PhaseTimer {
+  // Times a phase until it goes out of scope, stopped says whether the target
+  // is stopped for the whole phase.
+  struct Scope {
+    Scope(PhaseTimer* timer, std::string name, bool stopped) :
+      timer(timer), name(std::move(name)), stopped(stopped), start(nowMicros()) {}
+
+    Scope(Scope&& other) noexcept :
+      timer(other.timer), name(std::move(other.name)), stopped(other.stopped), start(other.start), running(other.running) {
+      other.timer = nullptr;
+    }
+
+    ~Scope() {
+      finish();
+    }
+
+    // Ends the current phase and starts timing the next one.
+    void next(std::string nextName, bool nextStopped) {
+      auto end = finish();
+      name = std::move(nextName);
+      stopped = nextStopped;
+      start = end;
+      running = true;
+    }
+
+    int64_t finish() {
+      auto end = nowMicros();
+      if (timer != nullptr && running) {
+        auto wall = end - start;
+        timer->add(name, wall, stopped ? wall : 0);
+        running = false;
+      }
+      return end;
+    }
+
+    PhaseTimer* timer;
+    std::string name;
+    bool stopped;
+    int64_t start;
+    bool running = true;
+  };
+
+  Scope phase(std::string name, bool stopped = false) {
+    return Scope(this, std::move(name), stopped);
+  }
+
+  void add(const std::string& name, int64_t wallMicros, int64_t stoppedMicros) {
+    phases.push_back({name, wallMicros, stoppedMicros});
+  }
+
+  // Total time the target was stopped across all phases.
+  int64_t stoppedMicros() const {
+    int64_t stopped = 0;
+    for (auto& phase : phases) stopped += phase.stoppedMicros;
+    return stopped;
+  }
+
+  void append(const PhaseTimer& other, const std::string& prefix) {
+    for (auto& phase : other.phases) add(prefix + phase.name, phase.wallMicros, phase.stoppedMicros);
+  }
+
+  std::string serialize() const {
+    std::ostringstream out;
+    for (auto& phase : phases) out << phase.name << '\t' << phase.wallMicros << '\t' << phase.stoppedMicros << '\n';
+    return out.str();
+  }
+
+  static PhaseTimer parse(const std::string& str) {
+    PhaseTimer timer;
+    std::istringstream in(str);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      PhaseTiming phase;
+      if (std::getline(fields, phase.name, '\t') && fields >> phase.wallMicros >> phase.stoppedMicros) {
+        timer.phases.push_back(phase);
+      }
+    }
+    return timer;
+  }
+
+  std::string table() const {
+    std::ostringstream out;
+    int64_t wall = 0, stopped = 0;
+    out << std::left << std::setw(28) << "Phase" << std::right << std::setw(12) << "Wall ms" << std::setw(14) << "Stopped ms" << '\n';
+    out << std::fixed << std::setprecision(3);
+    for (auto& phase : phases) {
+      out << std::left << std::setw(28) << phase.name << std::right
+          << std::setw(12) << phase.wallMicros / 1000.0 << std::setw(14) << phase.stoppedMicros / 1000.0 << '\n';
+      wall += phase.wallMicros;
+      stopped += phase.stoppedMicros;
+    }
+    out << std::left << std::setw(28) << "total" << std::right
+        << std::setw(12) << wall / 1000.0 << std::setw(14) << stopped / 1000.0;
+    return out.str();
+  }
+
+  std::string json() const {
+    std::ostringstream out;
+    int64_t wall = 0, stopped = 0;
+    out << "{\"phases\":[";
+    for (size_t i = 0; i < phases.size(); i++) {
+      auto& phase = phases[i];
+      if (i) out << ',';
+      out << "{\"name\":\"" << phase.name << "\",\"wall_us\":" << phase.wallMicros << ",\"stopped_us\":" << phase.stoppedMicros << '}';
+      wall += phase.wallMicros;
+      stopped += phase.stoppedMicros;
+    }
+    out << "],\"total_wall_us\":" << wall << ",\"total_stopped_us\":" << stopped << '}';
+    return out.str();
+  }
+
+  std::vector<PhaseTiming> phases;
+};
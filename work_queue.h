@@ -0,0 +1,68 @@
+#pragma once
+
+// Intrusive multi-producer single-consumer queue (Dmitry Vyukov's design).
+// Producers never block or take locks, the consumer may briefly see an empty
+// queue while a push is in progress and should retry after its wakeup.
+
+#include <atomic>
+#include <cstdint>
+
+struct WorkNode {
+  std::atomic<WorkNode*> next{nullptr};
+};
+
+struct WorkQueue {
+  WorkQueue() : head(&stub), tail(&stub) {}
+
+  void push(WorkNode* node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    auto prev = head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+    depth.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Only called from the consumer thread, returns null when empty.
+  WorkNode* pop() {
+    auto first = tail;
+    auto next = first->next.load(std::memory_order_acquire);
+
+    if (first == &stub) {
+      if (next == nullptr) return nullptr;
+      tail = next;
+      first = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+      tail = next;
+      return taken(first);
+    }
+
+    if (first != head.load(std::memory_order_acquire)) return nullptr;
+
+    push(&stub);
+    depth.fetch_sub(1, std::memory_order_relaxed);
+
+    next = first->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail = next;
+      return taken(first);
+    }
+    return nullptr;
+  }
+
+  int64_t size() const {
+    return depth.load(std::memory_order_relaxed);
+  }
+
+private:
+  WorkNode* taken(WorkNode* node) {
+    depth.fetch_sub(1, std::memory_order_relaxed);
+    return node;
+  }
+
+  std::atomic<WorkNode*> head;
+  WorkNode* tail;
+  WorkNode stub;
+  std::atomic<int64_t> depth{0};
+};